@@ -0,0 +1,34 @@
+/*
+   Copyright (C) 2022 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+#include "./mrzip_private.h"
+
+uchar * buf_alloc(rzip_control * control, i64 len);
+uchar * buf_grow(rzip_control * control, uchar * buf, i64 len);
+void buf_free(rzip_control * control, uchar * buf);
+void buf_pool_trim(rzip_control * control);
+void buf_pool_reuse(rzip_control * control);
+
+#define buf_dealloc(ptr)        \
+    do {                        \
+        buf_free(control, ptr); \
+        ptr = NULL;             \
+    } while (0)
+
+#endif
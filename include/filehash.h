@@ -0,0 +1,27 @@
+/*
+   Copyright (C) 2022 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEHASH_H
+#define FILEHASH_H
+#include "./mrzip_private.h"
+
+void file_hash_open(rzip_control * control, struct file_hash * fh);
+void file_hash_write(rzip_control * control, struct file_hash * fh, const void * buf, i64 len);
+void file_hash_read(rzip_control * control, struct file_hash * fh, uchar * resblock);
+void file_hash_close(rzip_control * control, struct file_hash * fh);
+
+#endif
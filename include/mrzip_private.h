@@ -22,6 +22,11 @@
 #define MRZIP_PRIV_H
 
 #define NUM_STREAMS 2
+/* With FLAG_SPLIT_STREAMS stream 0 only has the token heads and the
+ * checksum, and their lengths and offsets get streams of their own */
+#define NUM_SPLIT_STREAMS 4
+#define STREAM_LENGTHS 2
+#define STREAM_OFFSETS 3
 #define ONE_MB 1048576
 #define one_g (1000 * ONE_MB)
 #define STREAM_BUFSIZE (ONE_MB * 10)
@@ -37,6 +42,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "./config.h"
@@ -69,12 +75,13 @@ enum hashcodes {
     SHAKE128_64,
     SHAKE256_16,
     SHAKE256_32,
-    SHAKE256_64
+    SHAKE256_64,
+    BLAKE2B_TREE
 };
 
 enum enccodes { NONE = 0, AES128, AES256 };
 
-#define MAXHASH 13
+#define MAXHASH 14
 #define MAXENC 2
 
 extern struct hash {
@@ -141,6 +148,9 @@ extern struct encryption {
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 #define __maybe_unused __attribute__((unused))
+#ifndef __always_inline
+    #define __always_inline inline __attribute__((always_inline))
+#endif
 
 #if defined(__MINGW32__) || defined(__CYGWIN__) || defined(__ANDROID__) || defined(__APPLE__) || \
     defined(__OpenBSD__) || defined(__GCC__)
@@ -268,6 +278,9 @@ static inline unsigned char bzip3_prop_from_block_size(u32 bs) {
 #define FLAG_TMP_INBUF (1 << 22)
 #define FLAG_ENCRYPT (1 << 23)
 #define FLAG_BZIP3_COMPRESS (1 << 24)
+#define FLAG_FAR_MATCH (1 << 25)
+#define FLAG_SPLIT_STREAMS (1 << 26)
+#define FLAG_AUTO_COMPRESS (1 << 27)
 
 #define NO_HASH (!(HASH_CHECK) && !(HAS_HASH))
 
@@ -279,6 +292,8 @@ static inline unsigned char bzip3_prop_from_block_size(u32 bs) {
 #define CTYPE_ZPAQ 8
 #define CTYPE_BZIP3 9
 
+extern const char * ctype_names[];  // backend names by CTYPE_*, for messages
+
 #define PASS_LEN 512
 #define HASH_LEN 64
 #define SALT_LEN 8
@@ -322,7 +337,7 @@ static inline unsigned char bzip3_prop_from_block_size(u32 bs) {
 #define FLAG_VERBOSE (FLAG_VERBOSITY | FLAG_VERBOSITY_MAX)
 #define FLAG_NOT_LZMA                                                                                     \
     (FLAG_NO_COMPRESS | FLAG_LZ4_COMPRESS | FLAG_UNUSED_COMPRESS | FLAG_ZSTD_COMPRESS | FLAG_ZPAQ_COMPRESS | \
-     FLAG_BZIP3_COMPRESS)
+     FLAG_BZIP3_COMPRESS | FLAG_AUTO_COMPRESS)
 #define LZMA_COMPRESS (!(control->flags & FLAG_NOT_LZMA))
 
 #define SHOW_PROGRESS (control->flags & FLAG_SHOW_PROGRESS)
@@ -336,6 +351,7 @@ static inline unsigned char bzip3_prop_from_block_size(u32 bs) {
 #define ZSTD_COMPRESS (control->flags & FLAG_ZSTD_COMPRESS)
 #define ZPAQ_COMPRESS (control->flags & FLAG_ZPAQ_COMPRESS)
 #define BZIP3_COMPRESS (control->flags & FLAG_BZIP3_COMPRESS)
+#define AUTO_COMPRESS (control->flags & FLAG_AUTO_COMPRESS)
 #define VERBOSE (control->flags & FLAG_VERBOSE)
 #define VERBOSITY (control->flags & FLAG_VERBOSITY)
 #define MAX_VERBOSE (control->flags & FLAG_VERBOSITY_MAX)
@@ -351,25 +367,148 @@ static inline unsigned char bzip3_prop_from_block_size(u32 bs) {
 #define TMP_OUTBUF (control->flags & FLAG_TMP_OUTBUF)
 #define TMP_INBUF (control->flags & FLAG_TMP_INBUF)
 #define ENCRYPT (control->flags & FLAG_ENCRYPT)
+#define FAR_MATCH (control->flags & FLAG_FAR_MATCH)
+#define SPLIT_STREAMS (control->flags & FLAG_SPLIT_STREAMS)
+
+/* One mapped window of the sliding buffer's cache */
+struct sb_window {
+    uchar * buf;
+    i64 key;    /* Window number, offset >> SB_WINDOW_BITS, or -1 if unused */
+    i64 offset; /* Where buf starts */
+    i64 size;   /* How big it is */
+    i64 used;   /* When it was last looked up, for LRU */
+};
 
 struct sliding_buffer {
-    uchar * buf_low;   /* The low window buffer */
-    uchar * buf_high;  /* "" high "" */
-    i64 orig_offset;   /* Where the original buffer started */
-    i64 offset_low;    /* What the current offset the low buffer has */
-    i64 offset_high;   /* "" high buffer "" */
-    i64 offset_search; /* Where the search is up to */
-    i64 orig_size;     /* How big the full buffer would be */
-    i64 size_low;      /* How big the low buffer is */
-    i64 size_high;     /* "" high "" */
-    i64 high_length;   /* How big the high buffer should be */
-    int fd;            /* The fd of the mmap */
+    uchar * buf_low;         /* The low window buffer */
+    i64 orig_offset;         /* Where the original buffer started */
+    i64 offset_low;          /* What the current offset the low buffer has */
+    i64 offset_search;       /* Where the search is up to */
+    i64 orig_size;           /* How big the full buffer would be */
+    i64 size_low;            /* How big the low buffer is */
+    struct sb_window * high; /* Cache of windows for offsets outside the low buffer */
+    struct sb_window * last; /* The window of the last cache hit */
+    i64 high_clock;          /* Ticks on every cache lookup */
+    int fd;                  /* The fd of the mmap */
+    /* Background thread faulting in the low buffer ahead of the search */
+    bool prefetch;                 /* It is running, so remap under prefetch_lock */
+    bool prefetch_stop;            /* Asks it to finish */
+    i64 offset_prefetch;           /* How far it has touched */
+    pthread_mutex_t prefetch_lock; /* Held while it touches buf_low */
+};
+
+#define CKSUM_RING 64
+
+struct cksum_range {
+    const uchar * buf;
+    i64 len; /* 0 marks a drain, -1 asks the thread to finish */
 };
 
+/* Ranges of the input waiting for the checksum thread. Only the rzip thread
+ * fills the ring and only the checksum thread empties it. */
 struct checksum {
-    //	uint32_t *cksum;
+    struct cksum_range ring[CKSUM_RING];
+    unsigned head;   /* Next slot filled, advanced by the rzip thread */
+    unsigned tail;   /* Next slot hashed, advanced by the checksum thread */
+    cksem_t queued;  /* Posted for every range in the ring */
+    cksem_t drained; /* Posted when the thread reaches a drain marker */
+    pthread_t thread;
+    bool running;
+};
+
+/* The next stdin chunk, read by its own thread while the current chunk is
+ * searched and flushed. buf becomes the next low buffer. */
+struct read_ahead {
+    rzip_control * control;
     uchar * buf;
-    i64 len;
+    i64 size; /* Of the anonymous mapping */
+    i64 want; /* Bytes to read before the thread stops */
+    i64 len;  /* Bytes read so far */
+    bool eof;
+    pthread_t thread;
+};
+
+/* How far the current run got. The rzip and runzip loops only store their
+ * position in done, the reporter thread samples it (see progress.c). */
+struct progress {
+    i64 base;  /* Bytes before the current chunk */
+    i64 done;  /* Bytes of the current chunk */
+    i64 chunk; /* Size of the current chunk, 0 when not known */
+    i64 total; /* Size of the whole input, 0 when not known */
+    i64 start; /* Microseconds */
+    bool decompress;
+    bool stop;
+    bool running;
+    pthread_mutex_t lock; /* Taken for everything but done */
+    pthread_t thread;
+};
+
+/* --target-rate and --deadline: a ladder of backends and levels from the
+ * chosen one down to storing. Compression threads take the current rung and
+ * report how long their block took (see ratectl.c). */
+#define RATECTL_RUNGS 10
+
+struct ratectl {
+    double rate;  /* Bytes per second, 0 if not set */
+    i64 deadline; /* Seconds from the start, 0 if not set */
+    i64 start;    /* Microseconds */
+    struct {
+        uchar c_type; /* 0 for the backend chosen on the command line */
+        int level;
+        double spb; /* Seconds per byte on one thread, 0 until measured */
+    } rungs[RATECTL_RUNGS];
+    int nrungs, rung;
+    int workers; /* Blocks compressed side by side */
+    pthread_mutex_t lock;
+};
+
+/* What is done to get the output on disk, see writeback.c */
+#define WRITEBACK_NONE 0     /* Left to the kernel */
+#define WRITEBACK_PERIODIC 1 /* sync_file_range() in the background, writers throttled */
+#define WRITEBACK_CLOSE 2    /* One fsync() once the output is complete */
+
+struct writeback {
+    int policy;
+    int fd;    /* -1 when not looking after any */
+    i64 clean; /* Bytes known to be on disk */
+    bool waiting, stop, running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Wakes the thread */
+    pthread_cond_t done; /* Wakes writers waiting on it */
+    pthread_t thread;
+};
+
+/* How compressed blocks are written to an output file, see outq.c */
+#define OUTQ_WRITE 0  /* write(), seeking back to link each block in */
+#define OUTQ_PWRITE 1 /* Positional writes */
+#define OUTQ_URING 2  /* Positional writes queued on an io_uring */
+
+#define OUTQ_DEPTH 8 /* Writes in flight */
+#define OUTQ_BUFS 2  /* Blocks in flight */
+
+struct outq_req {
+    struct iovec iov[2];
+    int niov;
+    uchar head[32]; /* Block headers are copied here */
+    uchar * buf;    /* Given back to the pool once written */
+    i64 ofs, len;
+    bool busy;
+};
+
+struct outq {
+    int engine;
+    int fd;  /* -1 unless blocks are written through the queue */
+    i64 end; /* End of everything written so far */
+    int inflight, bufs;
+    struct outq_req req[OUTQ_DEPTH];
+    void * ring;
+};
+
+/* The whole file hash: a gcrypt digest or, for BLAKE2B_TREE, a tree hash
+ * computed by worker threads (see filehash.c) */
+struct file_hash {
+    gcry_md_hd_t md;
+    struct tree_hash * tree;
 };
 
 typedef i64 tag;
@@ -381,7 +520,6 @@ struct node {
 
 struct runzip_node {
     struct stream_info * sinfo;
-    pthread_t * pthreads;
     struct runzip_node * prev;
 };
 
@@ -396,7 +534,7 @@ struct rzip_state {
     i64 hash_count;
     i64 hash_limit;
     tag minimum_tag_mask;
-    i64 tag_clean_ptr;
+    i64 bitness_count[32]; /* entries by number of low tag bits set */
     i64 last_match;
     i64 chunk_size;
     i64 mmap_size;
@@ -404,12 +542,21 @@ struct rzip_state {
     uint32_t cksum;
     int fd_in, fd_out;
     char stdin_eof;
+    struct rzip_segment * segments;
+    uint64_t * far_index; /* anchors into earlier chunks, NULL if not matching across chunks */
+    char far_bits;
+    uchar * far_buf;
+    uchar * tokens[3]; /* token heads, lengths and offsets staged by put_token */
+    i64 tokens_len[3];
+    struct read_ahead ahead; /* Only used for STDIN, buf is NULL when idle */
     struct {
         i64 inserts;
         i64 literals;
         i64 literal_bytes;
         i64 matches;
         i64 match_bytes;
+        i64 far_matches;
+        i64 far_match_bytes;
         i64 tag_hits;
         i64 tag_misses;
     } stats;
@@ -457,7 +604,8 @@ struct rzip_control {
     i64 max_chunk;
     i64 max_mmap;
     int threads;
-    int threshold;  // threshold limit. 1-99%. Default no limiter
+    int rzip_threads;  // threads for the rzip pre-processing. 1 = serial
+    int threshold;  // threshold limit. 1-99%. Default 98
     char nice_val;  // added for consistency
     int current_priority;
     char major_version;
@@ -493,9 +641,8 @@ struct rzip_control {
     char * crc_label;   // CRC label
     int * crc_gcode;    // gcrypt CRC code
     int * crc_len;      // CRC length
-    cksem_t cksumsem;
     gcry_md_hd_t crc_handle;
-    gcry_md_hd_t hash_handle;
+    struct file_hash hash_handle;
     uchar * hash_resblock;  // block will have to be allocated at runtime
     i64 hash_read;          // How far into the file the hash has done so far
 
@@ -504,6 +651,10 @@ struct rzip_control {
     unsigned char magic_written;
 
     struct checksum checksum;
+    struct progress progress;
+    struct ratectl ratectl;
+    struct writeback writeback;
+    struct outq outq;
 
     const char * util_infile;
     char delete_infile;
@@ -513,16 +664,24 @@ struct rzip_control {
 
     char chunk_bytes;
     struct sliding_buffer sb;
-    void (*do_mcpy)(rzip_control *, unsigned char *, i64, i64);
-    void (*next_tag)(rzip_control *, struct rzip_state *, i64, tag *);
-    tag (*full_tag)(rzip_control *, struct rzip_state *, i64);
-    i64 (*match_len)(rzip_control *, struct rzip_state *, i64, i64, i64, i64 *);
 
-    pthread_t * pthreads;
     struct runzip_node * rulist;
     struct runzip_node * ruhead;
 };
 
+/* A backend job for the stream thread pool. ret and done are its future,
+ * see pool_wait() in stream.c */
+struct pool_task {
+    void * (*func)(struct pool_task *);
+    rzip_control * control;
+    struct stream_info * sinfo;
+    int no; /* The thread slot it runs for */
+    void * ret;
+    bool done;
+    struct codec_ctx * codec; /* Backend contexts of the worker running it */
+    struct pool_task * next;
+};
+
 struct uncomp_thread {
     uchar * s_buf;
     i64 u_len, c_len;
@@ -530,6 +689,7 @@ struct uncomp_thread {
     uchar c_type;
     int busy;
     int streamno;
+    struct pool_task task;
 };
 
 struct stream {
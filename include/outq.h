@@ -0,0 +1,28 @@
+/*
+   Copyright (C) 2022 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OUTQ_H
+#define OUTQ_H
+#include "./mrzip_private.h"
+
+void outq_start(rzip_control * control, int fd);
+void outq_write(rzip_control * control, uchar * head, int hlen, uchar * buf, i64 len, i64 ofs);
+void outq_reap(rzip_control * control);
+void outq_seek_end(rzip_control * control);
+void outq_stop(rzip_control * control);
+
+#endif
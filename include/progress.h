@@ -0,0 +1,37 @@
+/*
+   Copyright (C) 2022 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+#include "./mrzip_private.h"
+
+/* Hot loops report how far they got once every PROGRESS_BATCH bytes */
+#define PROGRESS_BATCH (64 * 1024)
+
+void progress_start(rzip_control * control, i64 total, bool decompress);
+void progress_chunk(rzip_control * control, i64 base, i64 size, i64 total);
+void progress_stop(rzip_control * control);
+
+static inline void progress_set(rzip_control * control, i64 done) {
+    __atomic_store_n(&control->progress.done, done, __ATOMIC_RELAXED);
+}
+
+static inline void progress_add(rzip_control * control, i64 done) {
+    __atomic_fetch_add(&control->progress.done, done, __ATOMIC_RELAXED);
+}
+
+#endif
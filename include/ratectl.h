@@ -0,0 +1,26 @@
+/*
+   Copyright (C) 2022 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RATECTL_H
+#define RATECTL_H
+#include "./mrzip_private.h"
+
+void ratectl_start(rzip_control * control);
+int ratectl_pick(rzip_control * control, uchar * c_type, int * level);
+void ratectl_record(rzip_control * control, int rung, i64 bytes, double seconds);
+
+#endif
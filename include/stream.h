@@ -27,15 +27,20 @@
 
 bool create_pthread(rzip_control * control, pthread_t * thread, pthread_attr_t * attr, void * (*start_routine)(void *),
                     void * arg);
-bool join_pthread(pthread_t th, void ** thread_return);
+bool join_pthread(rzip_control * control, pthread_t th, void ** thread_return);
 bool init_mutex(rzip_control * control, pthread_mutex_t * mutex);
 bool unlock_mutex(rzip_control * control, pthread_mutex_t * mutex);
 bool lock_mutex(rzip_control * control, pthread_mutex_t * mutex);
+bool init_cond(rzip_control * control, pthread_cond_t * cond);
+bool cond_wait(rzip_control * control, pthread_cond_t * cond, pthread_mutex_t * mutex);
+bool cond_timedwait(rzip_control * control, pthread_cond_t * cond, pthread_mutex_t * mutex, i64 usecs);
+bool cond_broadcast(rzip_control * control, pthread_cond_t * cond);
 ssize_t write_1g(rzip_control * control, void * buf, i64 len);
 ssize_t read_1g(rzip_control * control, int fd, void * buf, i64 len);
 i64 get_readseek(rzip_control * control, int fd);
 bool prepare_streamout_threads(rzip_control * control);
 bool close_streamout_threads(rzip_control * control);
+int pool_compress_workers(rzip_control * control);
 void * open_stream_out(rzip_control * control, int f, unsigned int n, i64 chunk_limit, char cbytes);
 void * open_stream_in(rzip_control * control, int f, int n, char cbytes);
 void flush_buffer(rzip_control * control, struct stream_info * sinfo, int stream);
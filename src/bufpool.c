@@ -0,0 +1,159 @@
+/*
+   Copyright (C) 2022 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../include/bufpool.h"
+
+#include <sys/mman.h>
+
+#include "../include/stream.h"
+#include "../include/util.h"
+
+/* The stream and backend buffers are large and come and go with every
+ * block. Buffers of at least BUF_POOL_MIN bytes are mapped on their own and
+ * kept when freed, so the next block of about the same size gets them back
+ * already faulted in. A free buffer is only handed out for requests needing
+ * at least half of it. No MADV_HUGEPAGE here: with defrag on madvise the
+ * first faults compact memory, which costs more than the pool saves. */
+#define BUF_POOL_MIN ONE_MB
+
+struct pool_buf {
+    uchar * buf;
+    i64 size;
+    bool used;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct pool_buf * bufs;
+    int nbufs, maxbufs;
+    i64 used, mapped; /* Bytes handed out and bytes mapped */
+    i64 used_high, mapped_high;
+    bool trimming; /* Unmap buffers as they are freed */
+} bp = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void unmap_buf(rzip_control * control, int i) {
+    if (unlikely(munmap(bp.bufs[i].buf, bp.bufs[i].size))) fatal("Failed to munmap pooled buffer\n");
+    bp.mapped -= bp.bufs[i].size;
+    bp.bufs[i] = bp.bufs[--bp.nbufs];
+}
+
+/* Returns NULL when out of memory, like malloc */
+uchar * buf_alloc(rzip_control * control, i64 len) {
+    struct pool_buf * b = NULL;
+    i64 size;
+    int i;
+
+    if (len < BUF_POOL_MIN) return malloc(len);
+    size = round_up_page(control, len);
+
+    lock_mutex(control, &bp.lock);
+    for (i = 0; i < bp.nbufs; i++) {
+        struct pool_buf * c = &bp.bufs[i];
+
+        if (!c->used && c->size >= size && c->size / 2 <= size && (!b || c->size < b->size)) b = c;
+    }
+    if (!b) {
+        uchar * buf;
+
+        /* Free buffers too small for this one will hardly be of use again */
+        for (i = 0; i < bp.nbufs; i++)
+            if (!bp.bufs[i].used && bp.bufs[i].size < size) unmap_buf(control, i--);
+        buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (buf == MAP_FAILED) {
+            unlock_mutex(control, &bp.lock);
+            return NULL;
+        }
+        if (bp.nbufs == bp.maxbufs) {
+            struct pool_buf * bufs;
+
+            bp.maxbufs = bp.maxbufs ? bp.maxbufs * 2 : 16;
+            bufs = realloc(bp.bufs, bp.maxbufs * sizeof(*bufs));
+            if (unlikely(!bufs)) fatal("Failed to realloc buffer pool\n");
+            bp.bufs = bufs;
+        }
+        b = &bp.bufs[bp.nbufs++];
+        b->buf = buf;
+        b->size = size;
+        bp.mapped += size;
+        bp.mapped_high = MAX(bp.mapped_high, bp.mapped);
+    }
+    b->used = true;
+    bp.used += b->size;
+    bp.used_high = MAX(bp.used_high, bp.used);
+    unlock_mutex(control, &bp.lock);
+    return b->buf;
+}
+
+/* Like realloc, but the contents are only kept up to the old buffer's end */
+uchar * buf_grow(rzip_control * control, uchar * buf, i64 len) {
+    i64 size = 0;
+    uchar * nbuf;
+    int i;
+
+    lock_mutex(control, &bp.lock);
+    for (i = 0; i < bp.nbufs; i++)
+        if (bp.bufs[i].buf == buf) size = bp.bufs[i].size;
+    unlock_mutex(control, &bp.lock);
+    if (!size) return realloc(buf, len);
+    if (len <= size) return buf;
+
+    nbuf = buf_alloc(control, len);
+    if (likely(nbuf)) memcpy(nbuf, buf, size);
+    buf_free(control, buf);
+    return nbuf;
+}
+
+void buf_free(rzip_control * control, uchar * buf) {
+    int i;
+
+    if (!buf) return;
+    lock_mutex(control, &bp.lock);
+    for (i = 0; i < bp.nbufs; i++) {
+        if (bp.bufs[i].buf == buf) {
+            bp.bufs[i].used = false;
+            bp.used -= bp.bufs[i].size;
+            if (bp.trimming) unmap_buf(control, i);
+            unlock_mutex(control, &bp.lock);
+            return;
+        }
+    }
+    unlock_mutex(control, &bp.lock);
+    free(buf);
+}
+
+/* Give back all the free buffers, and every buffer freed from now on till
+ * buf_pool_reuse(). Between chunks the last blocks of one are still being
+ * (de)compressed while the next is mapped and sized by the memory that is
+ * free, so they must not keep their buffers. */
+void buf_pool_trim(rzip_control * control) {
+    int i;
+
+    lock_mutex(control, &bp.lock);
+    bp.trimming = true;
+    print_maxverbose("Buffer pool high water: %'" PRId64 " bytes in use, %'" PRId64 " bytes mapped\n", bp.used_high,
+                     bp.mapped_high);
+    for (i = 0; i < bp.nbufs; i++)
+        if (!bp.bufs[i].used) unmap_buf(control, i--);
+    unlock_mutex(control, &bp.lock);
+}
+
+/* The streams of a new chunk are open, keep freed buffers for its blocks */
+void buf_pool_reuse(rzip_control * control) {
+    lock_mutex(control, &bp.lock);
+    bp.trimming = false;
+    unlock_mutex(control, &bp.lock);
+}
@@ -0,0 +1,201 @@
+/*
+   Copyright (C) 2022 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../include/filehash.h"
+
+#include "../common/blake2b.h"
+#include "../include/stream.h"
+#include "../include/util.h"
+
+/* BLAKE2B_TREE hashes the file in TREE_LEAF sized leaves, each with its own
+ * BLAKE2b-512. The digest is the BLAKE2b-512 of all the leaf digests in
+ * order followed by the file length as 8 little endian bytes. Leaves don't
+ * depend on each other, so worker threads hash them while the caller keeps
+ * on filling the next ones. */
+#define TREE_LEAF ONE_MB
+
+struct tree_leaf {
+    uchar * buf;
+    i64 len;
+    bool busy; /* Handed to its worker, digest not taken yet */
+    uchar digest[BLAKE2B_OUTBYTES];
+    cksem_t full; /* Posted when the leaf is handed to its worker */
+    cksem_t done; /* Posted when the worker has its digest */
+};
+
+struct tree_worker {
+    struct tree_hash * th;
+    int no;
+};
+
+/* Leaf i is always hashed by worker i % nworkers, two leaves per worker
+ * so that one can be filled while the other is hashed. */
+struct tree_hash {
+    rzip_control * control;
+    struct tree_leaf * leaves;
+    struct tree_worker * workers;
+    pthread_t * threads;
+    int nleaves, nworkers;
+    int cur; /* Leaf being filled */
+    bool stop;
+    i64 total;
+    blake2b_state root;
+};
+
+static void * tree_thread(void * data) {
+    struct tree_worker * w = (struct tree_worker *)data;
+    struct tree_hash * th = w->th;
+    rzip_control * control = th->control;
+    int i;
+
+    for (i = w->no;; i = (i + th->nworkers) % th->nleaves) {
+        struct tree_leaf * leaf = &th->leaves[i];
+        blake2b_state s;
+
+        cksem_wait(control, &leaf->full);
+        if (th->stop) break;
+        blake2b_init(&s, BLAKE2B_OUTBYTES);
+        blake2b_update(&s, leaf->buf, leaf->len);
+        blake2b_final(&s, leaf->digest, BLAKE2B_OUTBYTES);
+        cksem_post(control, &leaf->done);
+    }
+    return NULL;
+}
+
+static struct tree_hash * tree_hash_open(rzip_control * control) {
+    struct tree_hash * th;
+    int i;
+
+    th = calloc(1, sizeof(*th));
+    if (unlikely(!th)) fatal("Failed to calloc tree hash\n");
+    th->control = control;
+    th->nworkers = MAX(control->threads, 1);
+    th->nleaves = th->nworkers * 2;
+    th->leaves = calloc(th->nleaves, sizeof(*th->leaves));
+    th->workers = calloc(th->nworkers, sizeof(*th->workers));
+    th->threads = calloc(th->nworkers, sizeof(*th->threads));
+    if (unlikely(!th->leaves || !th->workers || !th->threads)) fatal("Failed to calloc tree hash\n");
+    for (i = 0; i < th->nleaves; i++) {
+        th->leaves[i].buf = malloc(TREE_LEAF);
+        if (unlikely(!th->leaves[i].buf)) fatal("Failed to malloc tree hash leaf\n");
+        cksem_init(control, &th->leaves[i].full);
+        cksem_init(control, &th->leaves[i].done);
+    }
+    blake2b_init(&th->root, BLAKE2B_OUTBYTES);
+    for (i = 0; i < th->nworkers; i++) {
+        th->workers[i].th = th;
+        th->workers[i].no = i;
+        create_pthread(control, &th->threads[i], NULL, tree_thread, &th->workers[i]);
+    }
+    return th;
+}
+
+static void tree_leaf_submit(struct tree_hash * th, struct tree_leaf * leaf) {
+    leaf->busy = true;
+    cksem_post(th->control, &leaf->full);
+    th->cur = (th->cur + 1) % th->nleaves;
+}
+
+/* Leaves are taken back in the order they were handed out */
+static void tree_leaf_absorb(struct tree_hash * th, struct tree_leaf * leaf) {
+    cksem_wait(th->control, &leaf->done);
+    blake2b_update(&th->root, leaf->digest, BLAKE2B_OUTBYTES);
+    leaf->busy = false;
+    leaf->len = 0;
+}
+
+static void tree_hash_write(struct tree_hash * th, const uchar * buf, i64 len) {
+    th->total += len;
+    while (len > 0) {
+        struct tree_leaf * leaf = &th->leaves[th->cur];
+        i64 n;
+
+        if (leaf->busy) tree_leaf_absorb(th, leaf);
+        n = MIN(TREE_LEAF - leaf->len, len);
+        memcpy(leaf->buf + leaf->len, buf, n);
+        leaf->len += n;
+        buf += n;
+        len -= n;
+        if (leaf->len == TREE_LEAF) tree_leaf_submit(th, leaf);
+    }
+}
+
+static void tree_hash_final(struct tree_hash * th, uchar * resblock) {
+    uchar total[8];
+    int i;
+
+    if (th->leaves[th->cur].len) tree_leaf_submit(th, &th->leaves[th->cur]);
+    for (i = 0; i < th->nleaves; i++) {
+        struct tree_leaf * leaf = &th->leaves[(th->cur + i) % th->nleaves];
+
+        if (leaf->busy) tree_leaf_absorb(th, leaf);
+    }
+    for (i = 0; i < 8; i++) total[i] = (uchar)(th->total >> (8 * i));
+    blake2b_update(&th->root, total, 8);
+    blake2b_final(&th->root, resblock, BLAKE2B_OUTBYTES);
+}
+
+static void tree_hash_close(struct tree_hash * th) {
+    rzip_control * control = th->control;
+    int i;
+
+    th->stop = true;
+    for (i = 0; i < th->nleaves; i++) cksem_post(control, &th->leaves[i].full);
+    for (i = 0; i < th->nworkers; i++) join_pthread(control, th->threads[i], NULL);
+    for (i = 0; i < th->nleaves; i++) dealloc(th->leaves[i].buf);
+    dealloc(th->leaves);
+    dealloc(th->workers);
+    dealloc(th->threads);
+    free(th);
+}
+
+void file_hash_open(rzip_control * control, struct file_hash * fh) {
+    fh->md = NULL;
+    fh->tree = NULL;
+    if (control->hash_code == BLAKE2B_TREE) {
+        fh->tree = tree_hash_open(control);
+        return;
+    }
+    gcry_md_open(&fh->md, *control->hash_gcode, GCRY_MD_FLAG_SECURE);
+    if (unlikely(fh->md == NULL)) fatal("Cannot create %s handle\n", control->hash_label);
+}
+
+void file_hash_write(rzip_control * control __maybe_unused, struct file_hash * fh, const void * buf, i64 len) {
+    if (fh->tree)
+        tree_hash_write(fh->tree, buf, len);
+    else
+        gcry_md_write(fh->md, buf, len);
+}
+
+void file_hash_read(rzip_control * control, struct file_hash * fh, uchar * resblock) {
+    /* if we're using an XOF function, i.e. SLACK128, then use md_extract */
+    if (fh->tree)
+        tree_hash_final(fh->tree, resblock);
+    else if (control->hash_code < SHAKE128_16)
+        memcpy(resblock, gcry_md_read(fh->md, *control->hash_gcode), *control->hash_len);
+    else
+        gcry_md_extract(fh->md, *control->hash_gcode, resblock, *control->hash_len);
+}
+
+void file_hash_close(rzip_control * control __maybe_unused, struct file_hash * fh) {
+    if (fh->tree)
+        tree_hash_close(fh->tree);
+    else
+        gcry_md_close(fh->md);
+    fh->tree = NULL;
+    fh->md = NULL;
+}
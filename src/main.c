@@ -59,7 +59,7 @@ bool progress_flag = false;
 /* These hash and encryption constants will be referenced in the
  * control structure. */
 
-#define MAXHASH 13
+#define MAXHASH 14
 #define MAXENC 2
 
 struct hash hashes[MAXHASH + 1] = {
@@ -77,6 +77,7 @@ struct hash hashes[MAXHASH + 1] = {
     { "SHAKE256_16", 11, GCRY_MD_SHAKE256, 16 }, /* XOF function */
     { "SHAKE256_32", 12, GCRY_MD_SHAKE256, 32 }, /* XOF function */
     { "SHAKE256_64", 13, GCRY_MD_SHAKE256, 64 }, /* XOF function */
+    { "BLAKE2B_TREE", 14, GCRY_MD_NONE, 64 },    /* multithreaded, see filehash.c */
 };
 
 struct encryption encryptions[MAXENC + 1] = {
@@ -85,6 +86,11 @@ struct encryption encryptions[MAXENC + 1] = {
     { "AES256", 2, GCRY_CIPHER_AES256, 32, 16 },
 };
 
+const char * ctype_names[CTYPE_BZIP3 + 1] = {
+    [CTYPE_NONE] = "none", [CTYPE_LZ4] = "lz4",   [CTYPE_LZMA] = "lzma",
+    [CTYPE_ZSTD] = "zstd", [CTYPE_ZPAQ] = "zpaq", [CTYPE_BZIP3] = "bzip3",
+};
+
 static rzip_control base_control, local_control, *control;
 
 static void usage(void) {
@@ -105,6 +111,7 @@ static void usage(void) {
                  "	-n, --no-compress	no backend compression - prepare for other compressor\n"
                  "	-z, --zpaq		zpaq compression (best, extreme compression, extremely slow)\n"
                  "	-B, --bzip3		bzip3 compression\n"
+                 "	--auto			pick lz4, zstd, bzip3 or lzma for every block by trial on a sample\n"
                  "	-L#, --level #		set lzma/zstd compression level (1-9, default 7)\n"
                  "	--fast			alias for -L1\n"
                  "	--best			alias for -L9\n"
@@ -126,10 +133,20 @@ static void usage(void) {
                  "\t\t\t\tOverrides detected amount of available ram. Useful for testing\n"
                  "	-R, --rzip-level level	Set independent RZIP Compression Level (1-9) for pre-processing "
                  "(default=compression level)\n"
-                 "	-T, --threshold [limit]	Disable LZ4 compressibility testing OR set limit to determine "
-                 "compressibiity (1-99)\n"
+                 "	-T, --threshold [limit]	Disable compressibility testing OR set limit to determine "
+                 "compressibiity (1-99, default 98)\n"
                  "\t\t\t\tNote: Since limit is optional, the short option must not have a space. e.g. -T75, not -T 75\n"
                  "	-U, --unlimited		Use unlimited window size beyond ramsize (potentially much slower)\n"
+                 "	--rzip-threads value	Split every chunk into segments searched by this many threads\n"
+                 "\t\t\t\tfor RZIP pre-processing (default 1, no splitting)\n"
+                 "	--split-streams		store match lengths and offsets in streams of their own\n"
+                 "	--target-rate MB/s	lower the level or switch to faster backends for blocks as needed\n"
+                 "\t\t\t\tto compress at least this fast\n"
+                 "	--deadline seconds	as --target-rate, at the rate needed to finish within this time\n"
+                 "	--writeback policy	none, periodic (default, background writeback and throttling) or\n"
+                 "\t\t\t\tclose (one fsync when the output is complete)\n"
+                 "	--io-engine engine	write, pwrite (default) or io_uring, when built with liburing, to\n"
+                 "\t\t\t\twrite compressed blocks\n"
                  "	-w, --window size	maximum compression window in hundreds of MB\n"
                  "\t\t\t\tdefault chosen by heuristic dependent on ram and chosen compression\n"
                  "Decompression Options:\n"
@@ -141,7 +158,7 @@ static void usage(void) {
                  "General Options:\n"
                  "----------------\n"
                  "	-h, -?, --help		show help\n"
-                 "	-H, --hash [hash code]	Set hash to compute (default md5) 1-13 (see manpage)\n"
+                 "	-H, --hash [hash code]	Set hash to compute (default md5) 1-14 (see manpage)\n"
                  "	-i, --info		show compressed file information\n"
                  "	-P, --progress		show compression progress\n"
                  "	-q, --quiet		don't show compression progress\n"
@@ -186,6 +203,8 @@ static char * compression_type(void) {
         return "ZPAQ";
     else if (BZIP3_COMPRESS)
         return "BZIP3";
+    else if (AUTO_COMPRESS)
+        return "AUTO (lz4, zstd, bzip3 or lzma per block)";
     else if (NO_COMPRESS)
         return "RZIP pre-processing only";
     fatal("Internal error in main.c:compression_type - unknown compression type.");
@@ -217,14 +236,17 @@ static void show_summary(void) {
         if (!DECOMPRESS && !TEST_ONLY) {
             print_verbose("Compression mode is: %s", compression_type());
             if (!LZ4_COMPRESS && !ZSTD_COMPRESS)
-                print_verbose(". LZ4 Compressibility testing %s\n", (LZ4_TEST ? "enabled" : "disabled"));
-            if (LZ4_TEST && control->threshold != 100) print_verbose("Threshhold limit = %'d%%\n", control->threshold);
+                print_verbose(". Compressibility testing %s\n", (LZ4_TEST ? "enabled" : "disabled"));
+            if (LZ4_TEST) print_verbose("Threshhold limit = %'d%%\n", control->threshold);
             print_verbose("Compression level %'d\n", control->compression_level);
             print_verbose("RZIP Compression level %'d\n", control->rzip_compression_level);
+            if (control->rzip_threads > 1) print_verbose("RZIP threads %'d\n", control->rzip_threads);
+            if (control->ratectl.rate) print_verbose("Target rate %.1fMB/s\n", control->ratectl.rate / ONE_MB);
+            if (control->ratectl.deadline) print_verbose("Deadline %'" PRId64 " seconds\n", control->ratectl.deadline);
             if (ZPAQ_COMPRESS)
                 print_verbose("ZPAQ Compression Level: %'d, ZPAQ initial Block Size: %'d\n", control->zpaq_level,
                               control->zpaq_bs);
-            if (BZIP3_COMPRESS)
+            if (BZIP3_COMPRESS || AUTO_COMPRESS)
                 print_verbose("BZIP3 Compression Block Size: %'" PRIu32 "\n", control->bzip3_block_size);
             print_verbose("%s Hashing Used\n", control->hash_label);
             if (ENCRYPT) print_verbose("%s Encryption Used\n", control->enc_label);
@@ -287,11 +309,18 @@ static struct option long_options[] = {
     { "lzma", no_argument, 0, 0 }, /* 34 - begin long opt index */
     { "zpaqbs", required_argument, 0, 0 },
     { "bzip3bs", required_argument, 0, 0 },
+    { "rzip-threads", required_argument, 0, 0 },
+    { "split-streams", no_argument, 0, 0 },
+    { "auto", no_argument, 0, 0 },
+    { "target-rate", required_argument, 0, 0 },
+    { "deadline", required_argument, 0, 0 },
+    { "writeback", required_argument, 0, 0 },
+    { "io-engine", required_argument, 0, 0 },
     { 0, 0, 0, 0 },
 };
 
 /* constants for ease of maintenance in getopt loop */
-#define LONGSTART 35
+#define LONGSTART 34
 
 static void set_stdout(struct rzip_control * control) {
     control->flags |= FLAG_STDOUT;
@@ -365,7 +394,7 @@ int main(int argc, char * argv[]) {
                  * because conf_file_compression_set will be true
                  */
                 if ((control->flags & FLAG_NOT_LZMA) && conf_file_compression_set == false)
-                    fatal("Can only use one of -l, -b, -g, -z, -B or -n\n");
+                    fatal("Can only use one of -l, -b, -g, -z, -B, -n or --auto\n");
                 /* Select Compression Mode */
                 control->flags &= ~FLAG_NOT_LZMA; /* must clear all compressions first */
                 if (c == 'Z')
@@ -549,8 +578,8 @@ int main(int argc, char * argv[]) {
                         }
                         break;
                     case LONGSTART + 2:
-                        if (!BZIP3_COMPRESS)
-                            print_err("--bzip3bs option only valid for BZIP3 compression. Ignored.\n");
+                        if (!BZIP3_COMPRESS && !AUTO_COMPRESS)
+                            print_err("--bzip3bs option only valid for BZIP3 or auto compression. Ignored.\n");
                         else {
                             ds = strtol(optarg, &endptr, 10);
                             if (*endptr) fatal("Extra characters after block size: \'%s\'\n", endptr);
@@ -559,6 +588,61 @@ int main(int argc, char * argv[]) {
                             control->bzip3_block_size = BZIP3_BLOCK_SIZE_FROM_PROP(ds);
                         }
                         break;
+                    case LONGSTART + 3:
+                        control->rzip_threads = strtol(optarg, &endptr, 10);
+                        if (*endptr) fatal("Extra characters after number of rzip threads: \'%s\'\n", endptr);
+                        if (control->rzip_threads < 1) fatal("Must have at least one rzip thread\n");
+                        break;
+                    case LONGSTART + 4:
+                        control->flags |= FLAG_SPLIT_STREAMS;
+                        break;
+                    case LONGSTART + 5:
+                        if ((control->flags & FLAG_NOT_LZMA) && conf_file_compression_set == false)
+                            fatal("Can only use one of -l, -b, -g, -z, -B, -n or --auto\n");
+                        control->flags &= ~FLAG_NOT_LZMA;
+                        control->flags |= FLAG_AUTO_COMPRESS;
+                        conf_file_compression_set = false;
+                        break;
+                    case LONGSTART + 6:
+                        control->ratectl.rate = strtod(optarg, &endptr) * ONE_MB;
+                        if (*endptr) fatal("Extra characters after target rate: \'%s\'\n", endptr);
+                        if (control->ratectl.rate <= 0) fatal("Target rate must be positive\n");
+                        break;
+                    case LONGSTART + 7:
+                        control->ratectl.deadline = strtol(optarg, &endptr, 10);
+                        if (*endptr) fatal("Extra characters after deadline: \'%s\'\n", endptr);
+                        if (control->ratectl.deadline < 1) fatal("Deadline must be positive\n");
+                        break;
+                    case LONGSTART + 8:
+                        if (!strcmp(optarg, "none"))
+                            control->writeback.policy = WRITEBACK_NONE;
+                        else if (!strcmp(optarg, "periodic")) {
+#ifdef NO_SYNC_FILE_RANGE
+                            print_err("Periodic writeback needs sync_file_range(), leaving it to the kernel.\n");
+                            control->writeback.policy = WRITEBACK_NONE;
+#else
+                            control->writeback.policy = WRITEBACK_PERIODIC;
+#endif
+                        } else if (!strcmp(optarg, "close"))
+                            control->writeback.policy = WRITEBACK_CLOSE;
+                        else
+                            fatal("Writeback policy must be none, periodic or close\n");
+                        break;
+                    case LONGSTART + 9:
+                        if (!strcmp(optarg, "write"))
+                            control->outq.engine = OUTQ_WRITE;
+                        else if (!strcmp(optarg, "pwrite"))
+                            control->outq.engine = OUTQ_PWRITE;
+                        else if (!strcmp(optarg, "io_uring")) {
+#ifdef HAVE_LIBURING
+                            control->outq.engine = OUTQ_URING;
+#else
+                            print_err("Built without io_uring support, using pwrite.\n");
+                            control->outq.engine = OUTQ_PWRITE;
+#endif
+                        } else
+                            fatal("I/O engine must be write, pwrite or io_uring\n");
+                        break;
                 }       // switch
                 break;  // break out of longopt switch
             default:    // oops
@@ -621,10 +705,15 @@ int main(int argc, char * argv[]) {
 
     /* if any filter used, disable LZ4 testing or certain compression modes */
     if ((control->flags & FLAG_THRESHOLD) && (ZSTD_COMPRESS || LZ4_COMPRESS || NO_COMPRESS)) {
-        print_output("LZ4 Threshold testing disabled due to Filtering and/or Compression type (zstd, lz4, rzip).\n");
+        print_output("Compressibility testing disabled due to Filtering and/or Compression type (zstd, lz4, rzip).\n");
         control->flags &= ~FLAG_THRESHOLD;
     }
 
+    if ((control->ratectl.rate || control->ratectl.deadline) && NO_COMPRESS) {
+        print_err("Nothing to speed up without a backend, --target-rate and --deadline ignored.\n");
+        control->ratectl.rate = control->ratectl.deadline = 0;
+    }
+
     setup_overhead(control);
 
     /* Set the main nice value to half that of the backend threads since
@@ -36,12 +36,19 @@
 #include "../include/rzip.h"
 #include "../include/stream.h"
 #include "../include/util.h"
+#include "../include/writeback.h"
 
 #define MAGIC_LEN (20)      // new v 0.9 magic header
 #define MAGIC_V8_LEN (18)   // new v 0.8 magic header
 #define OLD_MAGIC_LEN (24)  // Just to read older versions
 #define MAGIC_HEADER (6)    // to validate file initially
 
+#define MAGIC_FAR_MATCH (1 << 0)      // magic[16]: matches may reach into earlier chunks
+#define MAGIC_SPLIT_STREAMS (1 << 1)  // magic[16]: token lengths and offsets have streams of their own
+#define MAGIC_TREE_HASH (1 << 2)      // magic[16]: magic[14] is BLAKE2B_TREE, with its 64 byte trailer
+#define MAGIC_FLAGS (MAGIC_FAR_MATCH | MAGIC_SPLIT_STREAMS | MAGIC_TREE_HASH)
+#define MAGIC_FLAGS_MINOR (10)        // archives with magic[16] flags are 0.10, which 0.9 readers refuse
+
 static void release_hashes(rzip_control * control);
 
 static i64 fdout_seekto(rzip_control * control, i64 pos) {
@@ -144,6 +151,10 @@ bool write_magic(rzip_control * control) {
     if (HAS_HASH) magic[14] = control->hash_code; /* write whatever hash */
 
     magic[16] = 0;
+    if (FAR_MATCH) magic[16] |= MAGIC_FAR_MATCH;
+    if (SPLIT_STREAMS) magic[16] |= MAGIC_SPLIT_STREAMS;
+    if (HAS_HASH && control->hash_code == BLAKE2B_TREE) magic[16] |= MAGIC_TREE_HASH;
+    if (magic[16]) magic[5] = MAGIC_FLAGS_MINOR;
 
     /* save LZMA dictionary size */
     if (ZPAQ_COMPRESS) {
@@ -158,7 +169,7 @@ bool write_magic(rzip_control * control) {
          * zpaq_bs = magic byte & 0X0F
          * zpaq_level = magic_byte >> 4
          */
-    } else if (BZIP3_COMPRESS) {
+    } else if (BZIP3_COMPRESS || AUTO_COMPRESS) {
         /* Save block size. ZPAQ compression level is from 3 to 5, so this is sound.
            bzip3 blocksize is from 1 to 8 (or 0 to 7). */
         magic[17] = 0b11110000 + bzip3_prop_from_block_size(control->bzip3_block_size);
@@ -283,7 +294,7 @@ static void get_magic_v8(rzip_control * control, unsigned char * magic) {
 
 // new mrzip v9 magic header format.
 
-static void get_magic_v9(rzip_control * control, int fd_in, unsigned char * magic) {
+static bool get_magic_v9(rzip_control * control, int fd_in, unsigned char * magic) {
     /* get compression levels
      * rzip level is high order bits
      * mrzip level is low order bits
@@ -291,10 +302,23 @@ static void get_magic_v9(rzip_control * control, int fd_in, unsigned char * magi
     control->compression_level = magic[18] & 0b00001111;
     control->rzip_compression_level = magic[18] >> 4;
 
+    /* The flags came with 0.10, anything we don't know means a newer format */
+    if (unlikely((magic[16] & ~MAGIC_FLAGS) || (magic[16] && control->minor_version < MAGIC_FLAGS_MINOR))) {
+        print_err("Unknown archive flags %02x in mrzip version %d.%d archive. Aborting\n", magic[16],
+                  control->major_version, control->minor_version);
+        return false;
+    }
+    if (unlikely((magic[14] == BLAKE2B_TREE) != !!(magic[16] & MAGIC_TREE_HASH))) {
+        print_err("Hash code %d does not match archive flags %02x. Aborting\n", magic[14], magic[16]);
+        return false;
+    }
+    if (magic[16] & MAGIC_FAR_MATCH) control->flags |= FLAG_FAR_MATCH;
+    if (magic[16] & MAGIC_SPLIT_STREAMS) control->flags |= FLAG_SPLIT_STREAMS;
+
     if (magic[19]) /* get comment if there is one */
         get_comment(control, fd_in, magic);
 
-    return;
+    return true;
 }
 static bool get_magic(rzip_control * control, int fd_in, unsigned char * magic) {
     memcpy(&control->major_version, &magic[4], 1);
@@ -306,8 +330,9 @@ static bool get_magic(rzip_control * control, int fd_in, unsigned char * magic)
     if (control->major_version == 0) {
         switch (control->minor_version) {
             case 9: /* version 0.9 adds two bytes */
+            case MAGIC_FLAGS_MINOR:
                 get_magic_v8(control, magic);
-                get_magic_v9(control, fd_in, magic);
+                if (unlikely(!get_magic_v9(control, fd_in, magic))) return false;
                 break;
             default:
                 print_err("mrzip version %d.%d archive is not supported. Aborting\n", control->major_version,
@@ -440,6 +465,11 @@ bool flush_tmpoutbuf(rzip_control * control) {
             if (unlikely(!write_fdout(control, control->tmp_outbuf, control->out_len))) return false;
         }
     }
+    /* Far matches read earlier chunks back from the history file, so keep
+     * them in the temporary file when they don't go to a real one. */
+    if (FAR_MATCH && (DECOMPRESS || TEST_ONLY) && (STDOUT || TEST_ONLY) && control->fd_out != -1) {
+        if (unlikely(!write_fdout(control, control->tmp_outbuf, control->out_len))) return false;
+    }
     control->out_relofs += control->out_len;
     control->out_ofs = control->out_len = 0;
     return true;
@@ -455,15 +485,26 @@ bool dump_tmpoutfile(rzip_control * control, int fd_out) {
     fsync(fd_out);
     tmpoutfp = fdopen(fd_out, "r");
     if (unlikely(tmpoutfp == NULL)) fatal("Failed to fdopen out tmpfile\n");
-    rewind(tmpoutfp);
+    /* With far matches the file holds the history of every chunk, so only
+     * dump what stdout hasn't had yet, out_relofs on, and keep the rest */
+    if (FAR_MATCH) {
+        if (unlikely(fseeko(tmpoutfp, control->out_relofs, SEEK_SET)))
+            fatal("Failed to seek in out tmpfile in dump_tmpoutfile\n");
+    } else
+        rewind(tmpoutfp);
 
     if (!TEST_ONLY) {
         print_verbose("Dumping temporary file to control->outFILE.\n");
         while ((tmpchar = fgetc(tmpoutfp)) != EOF) putchar(tmpchar);
         fflush(control->outFILE);
-        rewind(tmpoutfp);
     }
 
+    if (FAR_MATCH) {
+        control->out_relofs = lseek(fd_out, 0, SEEK_END);
+        if (unlikely(control->out_relofs == -1)) fatal("Failed to seek to end of out tmpfile in dump_tmpoutfile\n");
+        return true;
+    }
+    rewind(tmpoutfp);
     if (unlikely(ftruncate(fd_out, 0))) fatal("Failed to ftruncate fd_out in dump_tmpoutfile\n");
     return true;
 }
@@ -744,9 +785,9 @@ static double percentage(i64 num, i64 den) {
 // using construct if (INFO)
 // Encrypted files cannot be checked now
 bool get_fileinfo(rzip_control * control) {
-    i64 u_len, c_len, second_last, last_head, utotal = 0, ctotal = 0, ofs, stream_head[2];
+    i64 u_len, c_len, second_last, last_head, utotal = 0, ctotal = 0, ofs, stream_head[NUM_SPLIT_STREAMS];
     i64 expected_size, infile_size, chunk_size = 0, chunk_total = 0;
-    int header_length = 0, stream = 0, chunk = 0;
+    int header_length = 0, stream = 0, chunk = 0, i;
     char *tmp, *infilecopy = NULL;
     char chunk_byte = 0;
     long double cratio, bpb;
@@ -799,6 +840,7 @@ bool get_fileinfo(rzip_control * control) {
             /* set header offsets for earlier versions */
             switch (control->minor_version) {
                 case 9:
+                case MAGIC_FLAGS_MINOR:
                     ofs = 22 + control->comment_length; /* comment? Add length */
                     break;
             }
@@ -813,6 +855,7 @@ bool get_fileinfo(rzip_control * control) {
             if (control->major_version == 0) {
                 switch (control->minor_version) {
                     case 9:
+                    case MAGIC_FLAGS_MINOR:
                         ofs = 22 + control->comment_length;
                         break;
                     default:
@@ -825,12 +868,12 @@ bool get_fileinfo(rzip_control * control) {
 
 next_chunk:
     stream = 0;
-    stream_head[0] = 0;
-    stream_head[1] = stream_head[0] + header_length;
+    for (i = 0; i < NUM_SPLIT_STREAMS; i++) stream_head[i] = i * header_length;
 
     if (!ENCRYPT) {
         chunk_total += chunk_size;
-        if (unlikely(chunk_byte && (chunk_byte > 8 || chunk_size <= 0))) fatal("Invalid chunk data\n");
+        /* Like open_stream_in, take an empty chunk: that is what an empty input compresses to */
+        if (unlikely(chunk_byte && (chunk_byte > 8 || chunk_size < 0))) fatal("Invalid chunk data\n");
     }
 
     if (INFO) {
@@ -842,7 +885,7 @@ next_chunk:
         else
             print_verbose("N/A %s Encrypted File\n", control->enc_label);
     }
-    while (stream < NUM_STREAMS) {
+    while (stream < (SPLIT_STREAMS ? NUM_SPLIT_STREAMS : NUM_STREAMS)) {
         int block = 1;
 
         second_last = 0;
@@ -1019,8 +1062,6 @@ done:
     if (HAS_HASH) {
         uchar * hash_stored;
 
-        int i;
-
         if (INFO) {
             hash_stored = calloc(*control->hash_len, 1);
             if (unlikely(lseek(fd_in, -*control->hash_len, SEEK_END) == -1))
@@ -1115,6 +1156,7 @@ bool compress_file(rzip_control * control) {
             fatal("Failed to create %s\n", control->outfile);
         }
         control->fd_out = fd_out;
+        writeback_start(control, fd_out);
         if (!STDIN) {
             if (unlikely(!preserve_perms(control, fd_in, fd_out))) goto error;
         }
@@ -1144,6 +1186,7 @@ bool compress_file(rzip_control * control) {
         fd_in = -1;
         goto error;
     }
+    if (!STDOUT) writeback_stop(control);
     if (unlikely(!STDOUT && close(fd_out))) fatal("Failed to close fd_out\n");
     if (TMP_OUTBUF) close_tmpoutbuf(control);
 
@@ -1287,6 +1330,7 @@ bool decompress_file(rzip_control * control) {
     }
     control->fd_out = fd_out;
     control->fd_hist = fd_hist;
+    if (!STDOUT && !TEST_ONLY) writeback_start(control, fd_out);
 
     show_version(control);
 
@@ -1342,6 +1386,7 @@ bool decompress_file(rzip_control * control) {
 
     if (TMP_OUTBUF) close_tmpoutbuf(control);
 
+    if (!STDOUT && !TEST_ONLY) writeback_stop(control);
     if (fd_out > 0)
         if (unlikely(close(fd_hist) || close(fd_out))) fatal("Failed to close files\n");
 
@@ -1375,9 +1420,18 @@ bool initialise_control(rzip_control * control) {
     control->rzip_compression_level =
         0; /* rzip compression level default will equal compression level unless explicitly set */
     control->ramsize = get_ram(control); /* if something goes wrong, exit from get_ram */
-    control->threshold = 100;            /* default for no threshold limiting */
+    control->threshold = 98;             /* backends won't win anything on data estimated above this */
     /* for testing single CPU */
     control->threads = PROCESSORS; /* get CPUs for LZMA */
+    control->rzip_threads = 1;     /* serial rzip pre-processing unless asked for */
+#ifdef NO_SYNC_FILE_RANGE
+    control->writeback.policy = WRITEBACK_NONE;
+#else
+    control->writeback.policy = WRITEBACK_PERIODIC;
+#endif
+    control->writeback.fd = -1;
+    control->outq.engine = OUTQ_PWRITE;
+    control->outq.fd = -1;
     control->page_size = PAGE_SIZE;
     control->nice_val = 19;
 
@@ -0,0 +1,222 @@
+/*
+   Copyright (C) 2022 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../include/outq.h"
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef HAVE_LIBURING
+    #include <liburing.h>
+#endif
+
+#include "../include/bufpool.h"
+#include "../include/stream.h"
+#include "../include/util.h"
+
+/* Compressed blocks going to an output file are written where they belong,
+ * header patches included, so the writer never seeks back and forth. With
+ * io_uring up to OUTQ_DEPTH writes, OUTQ_BUFS of them blocks, are in flight
+ * while the writer gets on with the next block, and a block's buffer goes
+ * back to the pool once the kernel is done with it. Without it every write
+ * is a pwritev(), done by the time it returns. */
+
+/* Finish writing the iovecs from done bytes in, after a short write */
+static void write_rest(rzip_control * control, int fd, struct iovec * iov, int niov, i64 ofs, i64 done) {
+    int i;
+
+    for (i = 0; i < niov; i++) {
+        uchar * p = iov[i].iov_base;
+        i64 len = iov[i].iov_len;
+
+        if (done >= len) {
+            done -= len;
+            ofs += len;
+            continue;
+        }
+        p += done;
+        ofs += done;
+        len -= done;
+        done = 0;
+        while (len > 0) {
+            ssize_t ret = pwrite(fd, p, len, ofs);
+
+            if (unlikely(ret <= 0))
+                fatal("Failed to write %'" PRId64 " bytes at %'" PRId64 " in outq: %s\n", len, ofs, strerror(errno));
+            p += ret;
+            ofs += ret;
+            len -= ret;
+        }
+    }
+}
+
+static void finish(rzip_control * control, struct outq_req * req) {
+    struct outq * q = &control->outq;
+
+    if (req->buf) {
+        buf_dealloc(req->buf);
+        q->bufs--;
+    }
+    if (req->busy) {
+        req->busy = false;
+        q->inflight--;
+    }
+}
+
+#ifdef HAVE_LIBURING
+/* Returns false when there was nothing to reap and we weren't to wait */
+static bool reap_one(rzip_control * control, bool wait) {
+    struct outq * q = &control->outq;
+    struct io_uring_cqe * cqe;
+    struct outq_req * req;
+    int ret, res;
+
+    do
+        ret = wait ? io_uring_wait_cqe(q->ring, &cqe) : io_uring_peek_cqe(q->ring, &cqe);
+    while (ret == -EINTR);
+    if (ret == -EAGAIN && !wait) return false;
+    if (unlikely(ret)) fatal("Failed to reap output writes: %s\n", strerror(-ret));
+    req = io_uring_cqe_get_data(cqe);
+    res = cqe->res;
+    io_uring_cqe_seen(q->ring, cqe);
+    if (unlikely(res < 0))
+        fatal("Failed to write %'" PRId64 " bytes at %'" PRId64 " in outq: %s\n", req->len, req->ofs, strerror(-res));
+    if (unlikely(res < req->len)) write_rest(control, q->fd, req->iov, req->niov, req->ofs, res);
+    finish(control, req);
+    return true;
+}
+#endif
+
+/* Blocks written to fd, a regular file, go through the queue from now on */
+void outq_start(rzip_control * control, int fd) {
+    struct outq * q = &control->outq;
+    struct stat st;
+
+    q->fd = -1;
+    if (q->engine == OUTQ_WRITE || fstat(fd, &st) || !S_ISREG(st.st_mode)) return;
+    q->end = lseek(fd, 0, SEEK_CUR);
+    if (unlikely(q->end == -1)) return;
+    q->inflight = q->bufs = 0;
+    memset(q->req, 0, sizeof(q->req));
+#ifdef HAVE_LIBURING
+    if (q->engine == OUTQ_URING) {
+        int ret;
+
+        q->ring = malloc(sizeof(struct io_uring));
+        if (unlikely(!q->ring)) fatal("Failed to malloc io_uring in outq_start\n");
+        ret = io_uring_queue_init(OUTQ_DEPTH, q->ring, 0);
+        if (unlikely(ret < 0)) {
+            print_verbose("Unable to set up io_uring (%s), using pwrite\n", strerror(-ret));
+            dealloc(q->ring);
+            q->engine = OUTQ_PWRITE;
+        }
+    }
+#endif
+    q->fd = fd;
+}
+
+/* Write hlen bytes of head followed by len bytes of buf at ofs. head is
+ * copied, buf belongs to the queue from now on and may be NULL. */
+void outq_write(rzip_control * control, uchar * head, int hlen, uchar * buf, i64 len, i64 ofs) {
+    struct outq * q = &control->outq;
+    struct outq_req * req;
+    ssize_t ret;
+    int i;
+
+    if (unlikely(hlen > (int)sizeof(req->head))) fatal("Header of %d bytes too long for outq\n", hlen);
+#ifdef HAVE_LIBURING
+    /* In flight writes may land in any order, so wait for the ones this
+     * one overlaps, typically the header of the stream's previous block */
+    for (i = 0; i < OUTQ_DEPTH && q->inflight; i++) {
+        struct outq_req * r = &q->req[i];
+
+        if (r->busy && r->ofs < ofs + hlen + len && ofs < r->ofs + r->len) {
+            reap_one(control, true);
+            i = -1;
+        }
+    }
+    while (q->inflight == OUTQ_DEPTH || (buf && q->bufs == OUTQ_BUFS)) reap_one(control, true);
+#endif
+    for (i = 0; q->req[i].busy; i++)
+        ;
+    req = &q->req[i];
+    memcpy(req->head, head, hlen);
+    req->niov = 0;
+    if (hlen) req->iov[req->niov++] = (struct iovec){ req->head, hlen };
+    if (len) req->iov[req->niov++] = (struct iovec){ buf, len };
+    req->buf = buf;
+    req->ofs = ofs;
+    req->len = hlen + len;
+    if (buf) q->bufs++;
+    q->end = MAX(q->end, ofs + req->len);
+
+#ifdef HAVE_LIBURING
+    if (q->engine == OUTQ_URING) {
+        struct io_uring_sqe * sqe = io_uring_get_sqe(q->ring);
+
+        if (unlikely(!sqe)) fatal("Failed to get an io_uring submission entry\n");
+        io_uring_prep_writev(sqe, q->fd, req->iov, req->niov, ofs);
+        io_uring_sqe_set_data(sqe, req);
+        req->busy = true;
+        q->inflight++;
+        ret = io_uring_submit(q->ring);
+        if (unlikely(ret < 0)) fatal("Failed to submit output write: %s\n", strerror(-ret));
+        return;
+    }
+#endif
+    ret = pwritev(q->fd, req->iov, req->niov, ofs);
+    if (unlikely(ret < 0))
+        fatal("Failed to write %'" PRId64 " bytes at %'" PRId64 " in outq: %s\n", req->len, ofs, strerror(errno));
+    if (unlikely(ret < req->len)) write_rest(control, q->fd, req->iov, req->niov, ofs, ret);
+    finish(control, req);
+}
+
+/* Give back the buffers of whatever was written meanwhile */
+void outq_reap(rzip_control * control __maybe_unused) {
+#ifdef HAVE_LIBURING
+    struct outq * q = &control->outq;
+
+    if (q->fd == -1 || q->engine != OUTQ_URING) return;
+    while (q->inflight && reap_one(control, false))
+        ;
+#endif
+}
+
+/* Leave the file offset past everything queued, for what is written after
+ * it with write() */
+void outq_seek_end(rzip_control * control) {
+    struct outq * q = &control->outq;
+
+    if (q->fd == -1) return;
+    if (unlikely(lseek(q->fd, q->end, SEEK_SET) != q->end)) fatal("Failed to seek to end of output in outq\n");
+}
+
+/* Wait for everything queued, the file is ours again */
+void outq_stop(rzip_control * control) {
+    struct outq * q = &control->outq;
+
+    if (q->fd == -1) return;
+#ifdef HAVE_LIBURING
+    if (q->engine == OUTQ_URING) {
+        while (q->inflight) reap_one(control, true);
+        io_uring_queue_exit(q->ring);
+        dealloc(q->ring);
+    }
+#endif
+    outq_seek_end(control);
+    q->fd = -1;
+}
@@ -0,0 +1,127 @@
+/*
+   Copyright (C) 2022 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../include/progress.h"
+
+#include <sys/time.h>
+
+#include "../include/stream.h"
+
+/* The reporter wakes up every PROGRESS_TICK microseconds to see whether it
+ * has to stop, and prints every PROGRESS_INTERVAL of them. */
+#define PROGRESS_TICK 100000
+#define PROGRESS_INTERVAL 5
+
+static i64 now_us(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (i64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void report(rzip_control * control) {
+    struct progress * pg = &control->progress;
+    static const i64 divisor[] = { 1, 1024, 1048576, 1073741824 };
+    static const char * suffix[] = { "", "KB", "MB", "GB" };
+    i64 base, done, chunk, total, elapsed;
+    double mbs;
+    int d;
+
+    lock_mutex(control, &pg->lock);
+    base = pg->base;
+    done = __atomic_load_n(&pg->done, __ATOMIC_RELAXED);
+    chunk = pg->chunk;
+    total = pg->total;
+    unlock_mutex(control, &pg->lock);
+
+    /* Workers of a parallel search may count a little past the chunk */
+    if (chunk) done = MIN(done, chunk);
+    elapsed = MAX(now_us() - pg->start, 1);
+    mbs = (double)(base + done) / ONE_MB / (elapsed / 1000000.0);
+
+    if (pg->decompress) {
+        for (d = 3; d > 0 && MAX(total, base + done) <= 10 * divisor[d]; d--)
+            ;
+        if (total)
+            print_progress("%3d%%  %9.2f / %9.2f %s  ", (int)(100 * (base + done) / total),
+                           (double)(base + done) / divisor[d], (double)total / divisor[d], suffix[d]);
+        else
+            print_progress("%9.2f %s  ", (double)(base + done) / divisor[d], suffix[d]);
+    } else {
+        if (total) print_progress("Total: %2d%%  ", (int)(100 * (base + done) / total));
+        if (chunk) print_progress("Chunk: %2d%%  ", (int)(100 * done / chunk));
+    }
+    print_progress("%6.2fMB/s", mbs);
+    if (total && base + done && base + done < total) {
+        i64 eta = (double)elapsed * (total - base - done) / (base + done) / 1000000;
+
+        print_progress("  ETA: %02d:%02d:%02d", (int)(eta / 3600), (int)(eta / 60 % 60), (int)(eta % 60));
+    }
+    print_progress("   \r");
+}
+
+static void * progress_thread(void * data) {
+    rzip_control * control = data;
+    struct progress * pg = &control->progress;
+    int ticks = 0;
+
+    while (!__atomic_load_n(&pg->stop, __ATOMIC_RELAXED)) {
+        usleep(PROGRESS_TICK);
+        if (++ticks % PROGRESS_INTERVAL == 0) report(control);
+    }
+    return NULL;
+}
+
+/* Nothing is started unless progress is shown, the hot loops still store
+ * their position but no one looks. */
+void progress_start(rzip_control * control, i64 total, bool decompress) {
+    struct progress * pg = &control->progress;
+
+    pg->base = pg->done = pg->chunk = 0;
+    pg->total = total;
+    pg->start = now_us();
+    pg->decompress = decompress;
+    pg->stop = false;
+    pg->running = SHOW_PROGRESS;
+    if (!pg->running) return;
+    init_mutex(control, &pg->lock);
+    create_pthread(control, &pg->thread, NULL, progress_thread, control);
+}
+
+/* A new chunk of size bytes starts base bytes into the input */
+void progress_chunk(rzip_control * control, i64 base, i64 size, i64 total) {
+    struct progress * pg = &control->progress;
+
+    if (pg->running) lock_mutex(control, &pg->lock);
+    pg->base = base;
+    pg->chunk = size;
+    pg->total = total;
+    __atomic_store_n(&pg->done, 0, __ATOMIC_RELAXED);
+    if (pg->running) unlock_mutex(control, &pg->lock);
+}
+
+/* Print where the run ended up and stop the reporter */
+void progress_stop(rzip_control * control) {
+    struct progress * pg = &control->progress;
+
+    if (!pg->running) return;
+    __atomic_store_n(&pg->stop, true, __ATOMIC_RELAXED);
+    join_pthread(control, pg->thread, NULL);
+    report(control);
+    pthread_mutex_destroy(&pg->lock);
+    pg->running = false;
+}
@@ -0,0 +1,151 @@
+/*
+   Copyright (C) 2022 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../include/ratectl.h"
+
+#include <math.h>
+#include <time.h>
+
+#include "../include/stream.h"
+
+/* Every block reports how long its backend took. The controller keeps a
+ * running seconds per byte for each rung, and moves one rung down when the
+ * threads together can't keep up with the rate needed, or one rung up when
+ * the rung above is expected to keep up with RATECTL_HEADROOM to spare.
+ * Blocks under RATECTL_MIN_BLOCK are too short to time. */
+#define RATECTL_HEADROOM 1.25
+#define RATECTL_MIN_BLOCK ONE_MB
+
+static i64 now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (i64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void add_rung(struct ratectl * rc, uchar c_type, int level) {
+    if (rc->nrungs == RATECTL_RUNGS) return;
+    rc->rungs[rc->nrungs].c_type = c_type;
+    rc->rungs[rc->nrungs].level = level;
+    rc->rungs[rc->nrungs++].spb = 0;
+}
+
+/* Lay out the rungs for the chosen backend and level, e.g. for lzma at 9:
+ * lzma 9, 7, 5, 3, 1, zstd 3, 1, lz4, none. The clock for --deadline starts
+ * with the first file. */
+void ratectl_start(rzip_control * control) {
+    struct ratectl * rc = &control->ratectl;
+    int level = control->compression_level, i;
+
+    if ((!rc->rate && !rc->deadline) || NO_COMPRESS) return;
+    if (!rc->start) {
+        rc->start = now_us();
+        init_mutex(control, &rc->lock);
+    }
+    rc->nrungs = rc->rung = 0;
+    rc->workers = pool_compress_workers(control);
+    add_rung(rc, 0, level);
+    if (LZMA_COMPRESS)
+        for (i = level - 2; i >= 1; i -= 2) add_rung(rc, CTYPE_LZMA, i);
+    if (ZSTD_COMPRESS) {
+        if (level > 3) add_rung(rc, CTYPE_ZSTD, 3);
+        if (level > 1) add_rung(rc, CTYPE_ZSTD, 1);
+    } else if (!LZ4_COMPRESS) {
+        add_rung(rc, CTYPE_ZSTD, 3);
+        add_rung(rc, CTYPE_ZSTD, 1);
+    }
+    if (!LZ4_COMPRESS || level > 1) add_rung(rc, CTYPE_LZ4, 1);
+    add_rung(rc, CTYPE_NONE, 0);
+
+    if (rc->deadline && STDIN) print_err("The input size is not known, --deadline only starts to count once it is\n");
+    for (i = 1; i < rc->nrungs; i++)
+        print_maxverbose("Rate control fallback %d: %s level %d\n", i, ctype_names[rc->rungs[i].c_type],
+                         rc->rungs[i].level);
+}
+
+/* The backend and level the next block is to use, c_type 0 being the one
+ * chosen on the command line. Returns the rung to report back to. */
+int ratectl_pick(rzip_control * control, uchar * c_type, int * level) {
+    struct ratectl * rc = &control->ratectl;
+    int rung;
+
+    if (!rc->nrungs) {
+        *c_type = 0;
+        *level = control->compression_level;
+        return 0;
+    }
+    lock_mutex(control, &rc->lock);
+    rung = rc->rung;
+    *c_type = rc->rungs[rung].c_type;
+    *level = rc->rungs[rung].level;
+    unlock_mutex(control, &rc->lock);
+    return rung;
+}
+
+/* Bytes per second the rest of the input has to go at */
+static double needed_rate(rzip_control * control) {
+    struct ratectl * rc = &control->ratectl;
+    struct progress * pg = &control->progress;
+    double need = rc->rate;
+    i64 total, done, left;
+
+    if (rc->deadline) {
+        total = __atomic_load_n(&pg->total, __ATOMIC_RELAXED);
+        done = __atomic_load_n(&pg->base, __ATOMIC_RELAXED) + __atomic_load_n(&pg->done, __ATOMIC_RELAXED);
+        left = rc->start + rc->deadline * 1000000 - now_us();
+        if (left <= 0) return HUGE_VAL;
+        if (total > done) need = MAX(need, (total - done) / (left / 1000000.0));
+    }
+    return need;
+}
+
+void ratectl_record(rzip_control * control, int rung, i64 bytes, double seconds) {
+    struct ratectl * rc = &control->ratectl;
+    double need, have, up, spb;
+
+    if (!rc->nrungs || bytes < RATECTL_MIN_BLOCK) return;
+    lock_mutex(control, &rc->lock);
+    spb = seconds / bytes;
+    rc->rungs[rung].spb = rc->rungs[rung].spb ? (rc->rungs[rung].spb + spb) / 2 : spb;
+    /* Blocks started before the last move say nothing about this rung */
+    if (rung != rc->rung) {
+        unlock_mutex(control, &rc->lock);
+        return;
+    }
+
+    need = needed_rate(control);
+    have = rc->workers / rc->rungs[rung].spb;
+    if (have < need && rc->rung + 1 < rc->nrungs)
+        rc->rung++;
+    else if (rc->rung > 0) {
+        /* Not measured yet, assume every rung up takes twice as long */
+        up = rc->rungs[rc->rung - 1].spb ? rc->workers / rc->rungs[rc->rung - 1].spb : have / 2;
+        if (up > need * RATECTL_HEADROOM) rc->rung--;
+    }
+    if (rc->rung != rung) {
+        if (isinf(need))
+            print_verbose("Rate control: past the deadline, ");
+        else
+            print_verbose("Rate control: %.1fMB/s needed, ", need / ONE_MB);
+        if (rc->rung)
+            print_verbose("%.1fMB/s done, going to %s level %d\n", have / ONE_MB,
+                          ctype_names[rc->rungs[rc->rung].c_type], rc->rungs[rc->rung].level);
+        else
+            print_verbose("%.1fMB/s done, back to level %d\n", have / ONE_MB, rc->rungs[0].level);
+    }
+    unlock_mutex(control, &rc->lock);
+}
@@ -27,13 +27,16 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "../include/bufpool.h"
+#include "../include/filehash.h"
 #include "../include/mrzip_core.h"
+#include "../include/progress.h"
 #include "../include/rzip.h"
 #include "../include/stream.h"
 #include "../include/util.h"
 
 /* Work Function to compute hash of a file stream */
-int hash_stream(FILE *, uchar *, int, int);
+int hash_stream(rzip_control *, FILE *, uchar *);
 
 static inline uchar read_u8(rzip_control * control, void * ss, int stream, bool * err) {
     uchar b;
@@ -114,7 +117,7 @@ static i64 read_header(rzip_control * control, void * ss, uchar * head) {
 
     *head = read_u8(control, ss, 0, &err);
     if (err) return -1;
-    return read_vchars(control, ss, 0, control->chunk_bytes);
+    return read_vchars(control, ss, SPLIT_STREAMS ? STREAM_LENGTHS : 0, control->chunk_bytes);
 }
 
 static i64 unzip_literal(rzip_control * control, void * ss, i64 len) {
@@ -140,7 +143,7 @@ static i64 unzip_literal(rzip_control * control, void * ss, i64 len) {
     if (!HAS_HASH)
         //		*cksum = CrcUpdate(*cksum, buf, stream_read);
         gcry_md_write(control->crc_handle, buf, stream_read);
-    if (HAS_HASH) gcry_md_write(control->hash_handle, buf, stream_read);
+    if (HAS_HASH) file_hash_write(control, &control->hash_handle, buf, stream_read);
 
     dealloc(buf);
     return stream_read;
@@ -167,7 +170,7 @@ static i64 unzip_match(rzip_control * control, void * ss, i64 len, int chunk_byt
     if (unlikely(cur_pos == -1)) fatal("Seek failed on out file in unzip_match.\n");
 
     /* Note the offset is in a different format v0.40+ */
-    offset = read_vchars(control, ss, 0, chunk_bytes);
+    offset = read_vchars(control, ss, SPLIT_STREAMS ? STREAM_OFFSETS : 0, chunk_bytes);
     if (unlikely(offset == -1)) return -1;
     if (unlikely(seekto_fdhist(control, cur_pos - offset) == -1))
         fatal("Seek failed by %'d from %'d on history file in unzip_match\n", offset, cur_pos);
@@ -195,7 +198,7 @@ static i64 unzip_match(rzip_control * control, void * ss, i64 len, int chunk_byt
         if (!HAS_HASH)
             //			*cksum = CrcUpdate(*cksum, buf, n);
             gcry_md_write(control->crc_handle, buf, n);
-        if (HAS_HASH) gcry_md_write(control->hash_handle, buf, n);
+        if (HAS_HASH) file_hash_write(control, &control->hash_handle, buf, n);
 
         len -= n;
         total += n;
@@ -206,13 +209,50 @@ static i64 unzip_match(rzip_control * control, void * ss, i64 len, int chunk_byt
     return total;
 }
 
+/* A far match copies from an earlier chunk, which has been flushed out of
+   tmp_outbuf already, so read it back from the history file. */
+static i64 unzip_far_match(rzip_control * control, void * ss, i64 len) {
+    i64 offset, pos, flushed, cur_pos;
+    uchar * buf;
+
+    if (unlikely(len < 0)) fatal("len %'" PRId64 " is negative in unzip_far_match!\n", len);
+    if (unlikely(control->fd_hist == -1)) fatal("No history file to resolve far match from\n");
+
+    cur_pos = seekcur_fdout(control);
+    if (unlikely(cur_pos == -1)) fatal("Seek failed on out file in unzip_far_match.\n");
+    flushed = TMP_OUTBUF ? control->out_relofs : cur_pos;
+
+    offset = read_vchars(control, ss, SPLIT_STREAMS ? STREAM_OFFSETS : 0, 8);
+    pos = cur_pos - offset;
+    if (unlikely(offset < 1 || pos < 0 || pos + len > flushed))
+        fatal("Far match of %'" PRId64 " bytes from %'" PRId64 " is outside the history, corrupt archive\n", len,
+              pos);
+
+    buf = (uchar *)malloc(len);
+    if (unlikely(!buf)) fatal("Failed to malloc match buffer of size %'" PRId64 "\n", len);
+
+    if (unlikely(pread(control->fd_hist, buf, len, pos) != len)) {
+        dealloc(buf);
+        fatal("Failed to read %'" PRId64 " bytes of history in unzip_far_match\n", len);
+    }
+    if (unlikely(write_1g(control, buf, len) != len)) {
+        dealloc(buf);
+        fatal("Failed to write %'" PRId64 " bytes in unzip_far_match\n", len);
+    }
+
+    if (!HAS_HASH) gcry_md_write(control->crc_handle, buf, len);
+    if (HAS_HASH) file_hash_write(control, &control->hash_handle, buf, len);
+
+    dealloc(buf);
+    return len;
+}
+
 void clear_rulist(rzip_control * control) {
     while (control->ruhead) {
         struct runzip_node * node = control->ruhead;
         struct stream_info * sinfo = node->sinfo;
 
         dealloc(sinfo->ucthreads);
-        dealloc(node->pthreads);
         dealloc(sinfo->s);
         dealloc(sinfo);
         control->ruhead = node->prev;
@@ -225,32 +265,12 @@ void clear_rulist(rzip_control * control) {
  */
 static i64 runzip_chunk(rzip_control * control, int fd_in, i64 expected_size, i64 tally) {
     uint32_t good_cksum, cksum = 0;
-    i64 len, ofs, total = 0;
-    int p;
+    i64 len, ofs, total = 0, next_progress = PROGRESS_BATCH;
     char chunk_bytes;
     struct stat st;
     uchar head;
     void * ss;
     bool err = false;
-    struct timeval curtime, lasttime;
-    lasttime.tv_sec = 0;
-
-    /* for display of progress */
-    unsigned long divisor[] = { 1, 1024, 1048576, 1073741824U };
-    char * suffix[] = { "", "KB", "MB", "GB" };
-    double prog_done, prog_tsize;
-    int divisor_index;
-
-    if (expected_size > (i64)10737418240ULL) /* > 10GB */
-        divisor_index = 3;
-    else if (expected_size > 10485760) /* > 10MB */
-        divisor_index = 2;
-    else if (expected_size > 10240) /* > 10KB */
-        divisor_index = 1;
-    else
-        divisor_index = 0;
-
-    prog_tsize = (long double)expected_size / (long double)divisor[divisor_index];
 
     /* remove checks for mrzip < 0.6 */
     if (control->major_version == 0) {
@@ -269,10 +289,11 @@ static i64 runzip_chunk(rzip_control * control, int fd_in, i64 expected_size, i6
 
     if (fstat(fd_in, &st) || st.st_size - ofs == 0) return 0;
 
-    ss = open_stream_in(control, fd_in, NUM_STREAMS, chunk_bytes);
+    ss = open_stream_in(control, fd_in, SPLIT_STREAMS ? NUM_SPLIT_STREAMS : NUM_STREAMS, chunk_bytes);
     if (unlikely(!ss)) fatal("Failed to open_stream_in in runzip_chunk\n");
 
     control->chunk_bytes = 2;
+    progress_chunk(control, tally, 0, expected_size);
 
     while ((len = read_header(control, ss, &head)) || head) {
         i64 u;
@@ -287,6 +308,15 @@ static i64 runzip_chunk(rzip_control * control, int fd_in, i64 expected_size, i6
                 total += u;
                 break;
 
+            case 2:
+                u = unzip_far_match(control, ss, len);
+                if (unlikely(u == -1)) {
+                    close_stream_in(control, ss);
+                    return -1;
+                }
+                total += u;
+                break;
+
             default:
                 u = unzip_match(control, ss, len, chunk_bytes);
                 if (unlikely(u == -1)) {
@@ -296,14 +326,9 @@ static i64 runzip_chunk(rzip_control * control, int fd_in, i64 expected_size, i6
                 total += u;
                 break;
         }
-        if (expected_size) {
-            p = 100 * ((double)(tally + total) / (double)expected_size);
-            gettimeofday(&curtime, NULL);
-            if (curtime.tv_sec - lasttime.tv_sec > 5 || p == 100) { /* update every 5 seconds or when done */
-                prog_done = (double)(tally + total) / (double)divisor[divisor_index];
-                print_progress("%3d%%  %9.2f / %9.2f %s\r", p, prog_done, prog_tsize, suffix[divisor_index]);
-                lasttime.tv_sec = curtime.tv_sec;
-            }
+        if (unlikely(total >= next_progress)) {
+            progress_set(control, total);
+            next_progress = total + PROGRESS_BATCH;
         }
     }
 
@@ -338,12 +363,9 @@ i64 runzip_fd(rzip_control * control, int fd_in, int fd_out, int fd_hist, i64 ex
     hash_stored = calloc(*control->hash_len, 1);
 
     gcry_md_open(&control->crc_handle, *control->crc_gcode, GCRY_MD_FLAG_SECURE);
-    if (HAS_HASH) {
-        gcry_md_open(&control->hash_handle, *control->hash_gcode, GCRY_MD_FLAG_SECURE);
-        if ((unlikely(control->hash_handle == NULL)))
-            fatal("Unable to set %s handle in runzip_fd\n", control->hash_label);
-    }
+    if (HAS_HASH) file_hash_open(control, &control->hash_handle);
     gettimeofday(&start, NULL);
+    progress_start(control, expected_size, true);
 
     do {
         u = runzip_chunk(control, fd_in, expected_size, total);
@@ -354,6 +376,7 @@ i64 runzip_fd(rzip_control * control, int fd_in, int fd_out, int fd_hist, i64 ex
             }
         }
         total += u;
+        progress_set(control, u);
         if (TMP_OUTBUF) {
             if (unlikely(!flush_tmpoutbuf(control))) {
                 print_err("Failed to flush_tmpoutbuf in runzip_fd\n");
@@ -374,6 +397,8 @@ i64 runzip_fd(rzip_control * control, int fd_in, int fd_out, int fd_hist, i64 ex
             }
         }
     } while (total < expected_size || (!expected_size && !control->eof));
+    progress_stop(control);
+    buf_pool_trim(control);
 
     gettimeofday(&end, NULL);
     if (!ENCRYPT) {
@@ -385,12 +410,8 @@ i64 runzip_fd(rzip_control * control, int fd_in, int fd_out, int fd_hist, i64 ex
     if (HAS_HASH) {
         int i, j;
 
-        /* if we're using an XOF function, i.e. SLACK128, then use md_extract */
-        if (control->hash_code < SHAKE128_16)
-            memcpy(control->hash_resblock, gcry_md_read(control->hash_handle, *control->hash_gcode),
-                   *control->hash_len);
-        else
-            gcry_md_extract(control->hash_handle, *control->hash_gcode, control->hash_resblock, *control->hash_len);
+        file_hash_read(control, &control->hash_handle, control->hash_resblock);
+        file_hash_close(control, &control->hash_handle);
 
         i64 fdinend = seekto_fdinend(control);
         if (unlikely(fdinend == -1)) fatal("Failed to seekto_fdinend in rzip_fd\n");
@@ -426,7 +447,7 @@ i64 runzip_fd(rzip_control * control, int fd_in, int fd_out, int fd_hist, i64 ex
             if (unlikely(seekto_fdhist(control, 0) == -1)) fatal("Failed to seekto_fdhist in runzip_fd\n");
             if (unlikely((hash_fstream = fdopen(fd_hist, "r")) == NULL))
                 fatal("Failed to fdopen fd_hist in runzip_fd\n");
-            if (unlikely(hash_stream(hash_fstream, control->hash_resblock, *control->hash_gcode, *control->hash_len)))
+            if (unlikely(hash_stream(control, hash_fstream, control->hash_resblock)))
                 fatal("Failed to %s_stream in runzip_fd\n", control->hash_label);
             /* We don't close the file here as it's closed in main */
             for (i = 0; i < *control->hash_len; i++) {
@@ -459,14 +480,14 @@ i64 runzip_fd(rzip_control * control, int fd_in, int fd_out, int fd_hist, i64 ex
    resulting message digest number will be written into the 16 bytes
    beginning at RESBLOCK.  */
 #define BLOCKSIZE 32768
-int hash_stream(FILE * stream, uchar * resblock, int hash_gcode, int hash_len) {
-    gcry_md_hd_t hash_handle;
+int hash_stream(rzip_control * control, FILE * stream, uchar * resblock) {
+    struct file_hash hash_handle;
     size_t sum;
 
     char * buffer = malloc(BLOCKSIZE + 72);
     if (!buffer) return 1;
 
-    gcry_md_open(&hash_handle, hash_gcode, GCRY_MD_FLAG_SECURE);
+    file_hash_open(control, &hash_handle);
 
     /* Iterate over full file contents.  */
     while (1) {
@@ -481,6 +502,7 @@ int hash_stream(FILE * stream, uchar * resblock, int hash_gcode, int hash_len) {
 
             if (n == 0) {
                 if (ferror(stream)) {
+                    file_hash_close(control, &hash_handle);
                     free(buffer);
                     return 1;
                 }
@@ -488,21 +510,16 @@ int hash_stream(FILE * stream, uchar * resblock, int hash_gcode, int hash_len) {
             }
             if (feof(stream)) goto process_partial_block;
         }
-        gcry_md_write(hash_handle, buffer, BLOCKSIZE);
+        file_hash_write(control, &hash_handle, buffer, BLOCKSIZE);
     }
 
 process_partial_block:
     /* Process any remaining bytes.  */
-    if (sum > 0) gcry_md_write(hash_handle, buffer, sum);
+    if (sum > 0) file_hash_write(control, &hash_handle, buffer, sum);
 
     /* Construct result in desired memory.  */
-    /* test for XOF */
-    if (hash_gcode < SHAKE128_16)
-        memcpy(resblock, gcry_md_read(hash_handle, hash_gcode), hash_len);
-    else
-        gcry_md_extract(hash_handle, hash_gcode, resblock, hash_len);
-
-    gcry_md_close(hash_handle);
+    file_hash_read(control, &hash_handle, resblock);
+    file_hash_close(control, &hash_handle);
     free(buffer);
     return 0;
 }
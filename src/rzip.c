@@ -23,7 +23,10 @@
 
 #include "../include/rzip.h"
 
+#include "../include/filehash.h"
 #include "../include/mrzip_core.h"
+#include "../include/progress.h"
+#include "../include/ratectl.h"
 #include "../include/runzip.h"
 #include "../include/stream.h"
 #include "../include/util.h"
@@ -31,6 +34,7 @@
 #define __USE_GNU
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -39,6 +43,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__SSE2__) || defined(__AVX2__) || defined(__AVX512BW__)
+    #include <immintrin.h>
+#endif
+
 #ifndef MAP_ANONYMOUS
     #define MAP_ANONYMOUS MAP_ANON
 #endif
@@ -48,19 +56,61 @@
 #define GREAT_MATCH 1024
 #define MINIMUM_MATCH 31
 
+/* How many positions ahead of the search the tags are computed to prefetch
+ * their hash buckets, so the probe and insert find them in cache. Can be
+ * tuned for the CPU at build time; 0 disables prefetching. */
+#ifndef HASH_PREFETCH_DISTANCE
+    #define HASH_PREFETCH_DISTANCE 16
+#endif
+
+/* The prefetch thread keeps the input faulted in up to PREFETCH_AHEAD bytes
+ * ahead of the search, PREFETCH_BATCH bytes at a time. */
+#define PREFETCH_AHEAD (64 * ONE_MB)
+#define PREFETCH_BATCH ONE_MB
+
+/* The checksum thread is handed the input CKSUM_BATCH bytes at a time */
+#define CKSUM_BATCH ONE_MB
+
+/* Matches into earlier chunks (far matches).  One tag in 2^FAR_ANCHOR_BITS
+ * is an anchor, remembered with its absolute offset in the file.  Far
+ * matches are verified by reading the earlier data back from the input
+ * file, FAR_MIN_READ bytes at first and up to FAR_BLOCK at a time. */
+#define FAR_ANCHOR_BITS 12
+#define FAR_ANCHOR_MASK (((tag)1 << FAR_ANCHOR_BITS) - 1)
+#define FAR_MIN_MATCH 512
+#define FAR_MIN_READ 4096
+#define FAR_BLOCK (64 * 1024)
+
 /* Hash table works as follows.  We start by throwing tags at every
  * offset into the table.  As it fills, we start eliminating tags
  * which don't have lower bits set to one (ie. first we eliminate all
  * even tags, then all tags divisible by four, etc.).  This ensures
  * that on average, all parts of the file are covered by the hash, if
- * sparsely. */
-
-/* All zero means empty.  We might miss the first chunk this way. */
+ * sparsely.
+ *
+ * The table is set-associative: a tag picks a bucket of HASH_WAYS entries
+ * filling one cache line, and a full bucket evicts its entry with the
+ * fewest low bits set.  Eliminated tags are not swept out; they just
+ * become the first victims of their bucket. */
+
+/* Entries are packed into 64 bits: the offset in the top 40 bits, then 5
+ * bits counting the low one bits of the tag (what the cleaning cares
+ * about) and 19 check bits taken from next to the bucket index.  False
+ * positives are caught by match_len.  All zero means empty.  We might miss
+ * the first chunk this way. */
 struct hash_entry {
-    i64 offset;
-    tag t;
+    uint64_t e;
 };
 
+#define HASH_KEY_BITS 24
+#define HASH_CHECK_BITS 19
+#define HASH_KEY_MASK ((1ULL << HASH_KEY_BITS) - 1)
+#define HASH_CHECK_MASK ((1ULL << HASH_CHECK_BITS) - 1)
+#define HASH_MAX_BITNESS 31
+#define HASH_WAYS_BITS 3
+#define HASH_WAYS (1 << HASH_WAYS_BITS)
+#define MAX_HASH_OFFSET (1LL << (64 - HASH_KEY_BITS))
+
 /* Levels control hashtable size and level. */
 static struct level {
     unsigned long mb_used;
@@ -72,108 +122,294 @@ static struct level {
     { 64, 1, 32 }, { 64, 1, 128 },
 };
 
+/* Tell the kernel the input mapping will be read soon, and may use huge
+ * pages.  These are only hints, so failures are ignored. */
+static void advise_input(uchar * buf, i64 len, i64 willneed) {
+#ifdef MADV_HUGEPAGE
+    madvise(buf, len, MADV_HUGEPAGE);
+#endif
+    if (willneed) madvise(buf, MIN(len, willneed), MADV_WILLNEED);
+}
+
+/* Perform all checksumming in a separate thread to speed up the hash search.
+ * It hashes the ranges queued by the rzip thread straight from the input
+ * buffer, in order. */
+static void * cksumthread(void * data) {
+    rzip_control * control = (rzip_control *)data;
+    struct checksum * ck = &control->checksum;
+    unsigned tail = 0;
+
+    while (42) {
+        struct cksum_range r;
+
+        cksem_wait(control, &ck->queued);
+        r = ck->ring[tail % CKSUM_RING];
+        if (r.len > 0) {
+            gcry_md_write(control->crc_handle, r.buf, r.len);
+            if (HAS_HASH) file_hash_write(control, &control->hash_handle, r.buf, r.len);
+        }
+        __atomic_store_n(&ck->tail, ++tail, __ATOMIC_RELEASE);
+        if (r.len == 0) cksem_post(control, &ck->drained);
+        if (r.len < 0) break;
+    }
+    return NULL;
+}
+
+/* Queue a range for the checksum thread. One slot is kept free for the
+ * markers, so this fails instead of waiting if the thread is behind. */
+static bool cksum_push(rzip_control * control, const uchar * buf, i64 len) {
+    struct checksum * ck = &control->checksum;
+
+    if (len > 0 && ck->head - __atomic_load_n(&ck->tail, __ATOMIC_ACQUIRE) >= CKSUM_RING - 1) return false;
+    ck->ring[ck->head % CKSUM_RING].buf = buf;
+    ck->ring[ck->head % CKSUM_RING].len = len;
+    __atomic_store_n(&ck->head, ck->head + 1, __ATOMIC_RELEASE);
+    cksem_post(control, &ck->queued);
+    return true;
+}
+
+/* Wait until everything queued so far has been hashed */
+static void cksum_drain(rzip_control * control) {
+    struct checksum * ck = &control->checksum;
+
+    if (!ck->running || ck->head == __atomic_load_n(&ck->tail, __ATOMIC_ACQUIRE)) return;
+    cksum_push(control, NULL, 0);
+    cksem_wait(control, &ck->drained);
+}
+
+static void start_cksum(rzip_control * control) {
+    struct checksum * ck = &control->checksum;
+
+    ck->head = ck->tail = 0;
+    cksem_init(control, &ck->queued);
+    cksem_init(control, &ck->drained);
+    create_pthread(control, &ck->thread, NULL, cksumthread, control);
+    ck->running = true;
+}
+
+static void stop_cksum(rzip_control * control) {
+    struct checksum * ck = &control->checksum;
+
+    if (!ck->running) return;
+    cksum_push(control, NULL, -1);
+    join_pthread(control, ck->thread, NULL);
+    ck->running = false;
+}
+
 static void remap_low_sb(rzip_control * control, struct sliding_buffer * sb) {
     i64 new_offset;
 
     new_offset = sb->offset_search;
     round_to_page(&new_offset);
     print_maxverbose("Sliding main buffer to offset %'" PRId64 "\n", new_offset);
+    /* The checksum thread may still be reading the old mapping */
+    cksum_drain(control);
+    if (sb->prefetch) lock_mutex(control, &sb->prefetch_lock);
     if (unlikely(munmap(sb->buf_low, sb->size_low))) fatal("Failed to munmap in remap_low_sb\n");
     if (new_offset + sb->size_low > sb->orig_size) sb->size_low = sb->orig_size - new_offset;
     sb->offset_low = new_offset;
     sb->buf_low =
         (uchar *)mmap(sb->buf_low, sb->size_low, PROT_READ, MAP_SHARED, sb->fd, sb->orig_offset + sb->offset_low);
     if (unlikely(sb->buf_low == MAP_FAILED)) fatal("Failed to re mmap in remap_low_sb\n");
+    advise_input(sb->buf_low, sb->size_low, PREFETCH_AHEAD);
+    if (sb->prefetch) unlock_mutex(control, &sb->prefetch_lock);
 }
 
-static inline void remap_high_sb(rzip_control * control, struct sliding_buffer * sb, i64 p) {
-    if (unlikely(munmap(sb->buf_high, sb->size_high))) fatal("Failed to munmap in remap_high_sb\n");
-    sb->size_high = sb->high_length; /* In case we shrunk it when we hit the end of the file */
-    sb->offset_high = p;
+/* Offsets outside the low buffer are served from a cache of SB_WINDOW sized
+ * mappings.  A window's number picks one of SB_CACHE_SETS sets, and each set
+ * holds SB_CACHE_WAYS windows replaced least recently used first. */
+#define SB_WINDOW_BITS 21
+#define SB_WINDOW (1LL << SB_WINDOW_BITS)
+#define SB_CACHE_SETS 16
+#define SB_CACHE_WAYS 4
+#define SB_CACHE_SLOTS (SB_CACHE_SETS * SB_CACHE_WAYS)
+
+static struct sb_window * map_high_sb(rzip_control * control, struct sliding_buffer * sb, i64 key) {
+    struct sb_window *set = &sb->high[key % SB_CACHE_SETS * SB_CACHE_WAYS], *w = set;
+    int i;
+
+    for (i = 1; i < SB_CACHE_WAYS; i++)
+        if (set[i].used < w->used) w = &set[i];
+    if (w->buf && unlikely(munmap(w->buf, w->size))) fatal("Failed to munmap in map_high_sb\n");
+    w->key = key;
+    w->offset = key << SB_WINDOW_BITS;
     /* Make sure offset is rounded to page size of total offset */
-    sb->offset_high -= (sb->offset_high + sb->orig_offset) % control->page_size;
-    if (unlikely(sb->offset_high + sb->size_high > sb->orig_size)) sb->size_high = sb->orig_size - sb->offset_high;
-    sb->buf_high =
-        (uchar *)mmap(sb->buf_high, sb->size_high, PROT_READ, MAP_SHARED, sb->fd, sb->orig_offset + sb->offset_high);
-    if (unlikely(sb->buf_high == MAP_FAILED)) fatal("Failed to re mmap in remap_high_sb\n");
+    w->offset -= (w->offset + sb->orig_offset) % control->page_size;
+    w->size = MIN((key + 1) << SB_WINDOW_BITS, sb->orig_size) - w->offset;
+    w->buf = (uchar *)mmap(NULL, w->size, PROT_READ, MAP_SHARED, sb->fd, sb->orig_offset + w->offset);
+    if (unlikely(w->buf == MAP_FAILED)) {
+        w->buf = NULL;
+        w->key = -1;
+        fatal("Failed to mmap in map_high_sb\n");
+    }
+    return w;
+}
+
+/* The window holding p, which must be outside the low buffer.  The window
+ * looked up last is never the one replaced by the next lookup, so a pointer
+ * into it stays good while a second one is fetched. */
+static inline struct sb_window * sliding_get_window(rzip_control * control, i64 p) {
+    struct sliding_buffer * sb = &control->sb;
+    i64 key = p >> SB_WINDOW_BITS;
+    struct sb_window * set;
+    int i;
+
+    if (likely(sb->last->key == key)) return sb->last;
+    set = &sb->high[key % SB_CACHE_SETS * SB_CACHE_WAYS];
+    for (i = 0; i < SB_CACHE_WAYS; i++)
+        if (set[i].key == key) break;
+    sb->last = i < SB_CACHE_WAYS ? &set[i] : map_high_sb(control, sb, key);
+    sb->last->used = ++sb->high_clock;
+    return sb->last;
+}
+
+static void init_high_sb(rzip_control * control, struct sliding_buffer * sb) {
+    int i;
+
+    if (!sb->high) {
+        sb->high = calloc(SB_CACHE_SLOTS, sizeof(*sb->high));
+        if (unlikely(!sb->high)) fatal("Failed to allocate sliding buffer cache\n");
+    }
+    for (i = 0; i < SB_CACHE_SLOTS; i++) {
+        sb->high[i].buf = NULL;
+        sb->high[i].key = -1;
+        sb->high[i].used = 0;
+    }
+    sb->last = &sb->high[0];
+    sb->high_clock = 0;
+}
+
+static void clear_high_sb(rzip_control * control, struct sliding_buffer * sb) {
+    int i;
+
+    for (i = 0; i < SB_CACHE_SLOTS; i++) {
+        if (sb->high[i].buf && unlikely(munmap(sb->high[i].buf, sb->high[i].size)))
+            fatal("Failed to munmap in clear_high_sb\n");
+        sb->high[i].buf = NULL;
+        sb->high[i].key = -1;
+    }
 }
 
 /* We use a "sliding mmap" to effectively read more than we can fit into the
  * compression window. This is done by using a maximally sized lower mmap at
  * the beginning of the block which slides up once the hash search moves beyond
- * it, and a 64k mmap block that slides up and down as is required for any
- * offsets outside the range of the lower one. This is much slower than mmap
- * but makes it possible to have unlimited sized compression windows.
- * We use a pointer to the function we actually want to use and only enable
- * the sliding mmap version if we need sliding mmap functionality as this is
- * a hot function during the rzip phase */
-static uchar * sliding_get_sb(rzip_control * control, i64 p) {
-    struct sliding_buffer * sb = &control->sb;
-    i64 sbo;
-
-    sbo = sb->offset_low;
-    if (p >= sbo && p < sbo + sb->size_low) return (sb->buf_low + p - sbo);
-    sbo = sb->offset_high;
-    if (p >= sbo && p < (sbo + sb->size_high)) return (sb->buf_high + (p - sbo));
-    /* p is not within the low or high buffer range */
-    remap_high_sb(control, &control->sb, p);
-    /* Use sb->offset_high directly since it will have changed */
-    return (sb->buf_high + (p - sb->offset_high));
-}
-
-/* The length of continous range of the sliding buffer,
- * starting from the offset P.
- */
-static inline i64 sliding_get_sb_range(rzip_control * control, i64 p) {
+ * it, and a cache of 2MB mmap windows for any offsets outside the range of the
+ * lower one. This is slower than mmap but makes it possible to have unlimited
+ * sized compression windows.
+ * The hash search is specialised for both cases (see hash_search below) and
+ * the sliding mmap version is only used if we need sliding mmap functionality
+ * as this is a hot function during the rzip phase */
+static inline uchar * sliding_get_sb(rzip_control * control, i64 p) {
     struct sliding_buffer * sb = &control->sb;
-    i64 sbo, sbs;
+    struct sb_window * w;
 
-    sbo = sb->offset_low;
-    sbs = sb->size_low;
-    if (p >= sbo && p < sbo + sbs) return (sbs - (p - sbo));
-    sbo = sb->offset_high;
-    sbs = sb->size_high;
-    if (likely(p >= sbo && p < (sbo + sbs))) return (sbs - (p - sbo));
+    if (p >= sb->offset_low && p < sb->offset_low + sb->size_low) return (sb->buf_low + p - sb->offset_low);
+    w = sliding_get_window(control, p);
+    return (w->buf + (p - w->offset));
+}
 
-    fatal("sliding_get_sb_range: the pointer is out of range\n");
+/* Same as sliding_get_sb, also giving how many bytes are mapped contiguously
+ * before p (before) and from p on (after). */
+static inline uchar * sliding_get_span(rzip_control * control, i64 p, i64 * before, i64 * after) {
+    struct sliding_buffer * sb = &control->sb;
+    struct sb_window * w;
+
+    if (p >= sb->offset_low && p < sb->offset_low + sb->size_low) {
+        *before = p - sb->offset_low;
+        *after = sb->offset_low + sb->size_low - p;
+        return (sb->buf_low + p - sb->offset_low);
+    }
+    w = sliding_get_window(control, p);
+    *before = p - w->offset;
+    *after = w->offset + w->size - p;
+    return (w->buf + (p - w->offset));
 }
 
 /* Since the sliding get_sb only allows us to access one byte at a time, we
  * do the same as we did with get_sb with the memcpy since one memcpy is much
  * faster than numerous memcpys 1 byte at a time */
-static void single_mcpy(rzip_control * control, unsigned char * buf, i64 offset, i64 len) {
+static inline void single_mcpy(rzip_control * control, unsigned char * buf, i64 offset, i64 len) {
     memcpy(buf, control->sb.buf_low + offset, len);
 }
 
 static void sliding_mcpy(rzip_control * control, unsigned char * buf, i64 offset, i64 len) {
-    i64 n = 0;
+    i64 n = 0, before, after;
 
     while (n < len) {
-        uchar * srcbuf = sliding_get_sb(control, offset + n);
-        i64 m = MIN(sliding_get_sb_range(control, offset + n), len - n);
+        uchar * srcbuf = sliding_get_span(control, offset + n, &before, &after);
+        i64 m = MIN(after, len - n);
 
         memcpy(buf + n, srcbuf, m);
         n += m;
     }
 }
 
-/* All put_u8/u32/vchars go to stream 0 */
-static inline void put_u8(rzip_control * control, void * ss, uchar b) { write_stream(control, ss, 0, &b, 1); }
+/* Every helper taking a `sliding' argument is forced inline and only ever
+ * called with a constant, so the compiler generates a separate single mmap
+ * and sliding mmap copy of the whole hash search with no indirect calls. */
+static __always_inline void do_mcpy(rzip_control * control, unsigned char * buf, i64 offset, i64 len,
+                                    const bool sliding) {
+    if (sliding)
+        sliding_mcpy(control, buf, offset, len);
+    else
+        single_mcpy(control, buf, offset, len);
+}
 
-static inline void put_u32(rzip_control * control, void * ss, uint32_t s) {
-    s = htole32(s);
-    write_stream(control, ss, 0, (uchar *)&s, 4);
+/* Tokens are staged in st->tokens and handed to write_stream TOKENS_SIZE
+ * bytes at a time.  Normally they all go to tokens[0] for stream 0, and
+ * MAX_TOKEN is the most one token can take there: head, 2 bytes of length
+ * and up to 8 bytes of offset.  With split streams the heads, lengths and
+ * offsets are staged apart, for the streams in token_streams. */
+#define TOKENS_SIZE (64 * 1024)
+#define MAX_TOKEN 11
+
+static const int token_streams[3] = { 0, STREAM_LENGTHS, STREAM_OFFSETS };
+
+static void flush_tokens(rzip_control * control, struct rzip_state * st) {
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (st->tokens_len[i]) write_stream(control, st->ss, token_streams[i], st->tokens[i], st->tokens_len[i]);
+        st->tokens_len[i] = 0;
+    }
 }
 
-/* Put a variable length of bytes dependant on how big the chunk is */
-static void put_vchars(rzip_control * control, void * ss, i64 s, i64 length) {
-    s = htole64(s);
-    write_stream(control, ss, 0, (uchar *)&s, length);
+/* Put a token: head, 2 bytes of length and ofs_bytes of offset, which may
+ * be 0.  All 8 offset bytes are stored and only ofs_bytes of them kept. */
+static inline void put_token(rzip_control * control, struct rzip_state * st, uchar head, i64 len, i64 ofs,
+                             int ofs_bytes) {
+    uint64_t le = htole64(ofs);
+    uchar * t;
+
+    if (likely(!SPLIT_STREAMS)) {
+        if (unlikely(st->tokens_len[0] > TOKENS_SIZE - MAX_TOKEN)) flush_tokens(control, st);
+        t = st->tokens[0] + st->tokens_len[0];
+        t[0] = head;
+        t[1] = len & 0xFF;
+        t[2] = len >> 8;
+        memcpy(t + 3, &le, 8);
+        st->tokens_len[0] += 3 + ofs_bytes;
+        return;
+    }
+
+    if (unlikely(st->tokens_len[0] == TOKENS_SIZE || st->tokens_len[1] > TOKENS_SIZE - 2 ||
+                 st->tokens_len[2] > TOKENS_SIZE - 8))
+        flush_tokens(control, st);
+    st->tokens[0][st->tokens_len[0]++] = head;
+    t = st->tokens[1] + st->tokens_len[1];
+    t[0] = len & 0xFF;
+    t[1] = len >> 8;
+    st->tokens_len[1] += 2;
+    memcpy(st->tokens[2] + st->tokens_len[2], &le, 8);
+    st->tokens_len[2] += ofs_bytes;
 }
 
-static void put_header(rzip_control * control, void * ss, uchar head, i64 len) {
-    put_u8(control, ss, head);
-    put_vchars(control, ss, len, 2);
+/* The checksum always goes to stream 0 */
+static inline void put_u32(rzip_control * control, struct rzip_state * st, uint32_t s) {
+    s = htole32(s);
+    if (unlikely(st->tokens_len[0] > TOKENS_SIZE - 4)) flush_tokens(control, st);
+    memcpy(st->tokens[0] + st->tokens_len[0], &s, 4);
+    st->tokens_len[0] += 4;
 }
 
 static inline void put_match(rzip_control * control, struct rzip_state * st, i64 p, i64 offset, i64 len) {
@@ -183,8 +419,7 @@ static inline void put_match(rzip_control * control, struct rzip_state * st, i64
         if (n > 0xFFFF) n = 0xFFFF;
 
         ofs = (p - offset);
-        put_header(control, st->ss, 1, n);
-        put_vchars(control, st->ss, ofs, st->chunk_bytes);
+        put_token(control, st, 1, n, ofs, st->chunk_bytes);
         st->stats.matches++;
         st->stats.match_bytes += n;
         len -= n;
@@ -193,14 +428,31 @@ static inline void put_match(rzip_control * control, struct rzip_state * st, i64
     } while (len);
 }
 
+/* A far match gives the distance back from the current position in the whole
+   file, which may not fit in chunk_bytes. */
+static inline void put_far_match(rzip_control * control, struct rzip_state * st, i64 p, i64 offset, i64 len) {
+    do {
+        i64 n = len;
+        if (n > 0xFFFF) n = 0xFFFF;
+
+        put_token(control, st, 2, n, control->sb.orig_offset + p - offset, 8);
+        st->stats.far_matches++;
+        st->stats.far_match_bytes += n;
+        len -= n;
+        p += n;
+        offset += n;
+    } while (len);
+}
+
 /* write some data to a stream mmap encoded. Return -1 on failure */
-static inline void write_sbstream(rzip_control * control, void * ss, int stream, i64 p, i64 len) {
+static __always_inline void write_sbstream(rzip_control * control, void * ss, int stream, i64 p, i64 len,
+                                           const bool sliding) {
     struct stream_info * sinfo = ss;
 
     while (len) {
         i64 n = MIN(sinfo->bufsize - sinfo->s[stream].buflen, len);
 
-        control->do_mcpy(control, sinfo->s[stream].buf + sinfo->s[stream].buflen, p, n);
+        do_mcpy(control, sinfo->s[stream].buf + sinfo->s[stream].buflen, p, n, sliding);
 
         sinfo->s[stream].buflen += n;
         p += n;
@@ -210,7 +462,8 @@ static inline void write_sbstream(rzip_control * control, void * ss, int stream,
     }
 }
 
-static void put_literal(rzip_control * control, struct rzip_state * st, i64 last, i64 p) {
+static __always_inline void put_literal(rzip_control * control, struct rzip_state * st, i64 last, i64 p,
+                                        const bool sliding) {
     do {
         i64 len = p - last;
 
@@ -219,115 +472,134 @@ static void put_literal(rzip_control * control, struct rzip_state * st, i64 last
         st->stats.literals++;
         st->stats.literal_bytes += len;
 
-        put_header(control, st->ss, 0, len);
+        put_token(control, st, 0, len, 0, 0);
 
-        if (len) write_sbstream(control, st->ss, 1, last, len);
+        if (len) write_sbstream(control, st->ss, 1, last, len, sliding);
         last += len;
     } while (p > last);
 }
 
 /* Could give false positive on offset 0.  Who cares. */
-static inline bool empty_hash(struct hash_entry * he) { return !(he->offset | he->t); }
+static inline bool empty_hash(struct hash_entry * he) { return !he->e; }
 
-static i64 primary_hash(struct rzip_state * st, tag t) { return t & ((1 << st->hash_bits) - 1); }
+static inline i64 bucket_bits(struct rzip_state * st) { return st->hash_bits - HASH_WAYS_BITS; }
 
-static inline tag increase_mask(tag tag_mask) {
-    /* Get more precise. */
-    return (tag_mask << 1) | 1;
+/* Tags that pass the tag mask all share their low bits, so spread them with
+ * a multiplicative hash.  Its top bits pick the bucket and the ones below
+ * give the check bits. */
+static inline uint64_t mix_tag(tag t) { return (uint64_t)t * 0x9E3779B97F4A7C15ULL; }
+
+static inline struct hash_entry * primary_bucket(struct rzip_state * st, tag t) {
+    return &st->hash_table[(mix_tag(t) >> (64 - bucket_bits(st))) << HASH_WAYS_BITS];
 }
 
-static inline bool minimum_bitness(struct rzip_state * st, tag t) {
-    tag better_than_min = increase_mask(st->minimum_tag_mask);
+/* Number of low bits set, capped to what fits in an entry. */
+static inline unsigned bitness(tag t) {
+    unsigned b = ffsll(~t) - 1;
 
-    if ((t & better_than_min) != better_than_min) return true;
-    return false;
+    if (unlikely(!~t || b > HASH_MAX_BITNESS)) return HASH_MAX_BITNESS;
+    return b;
 }
 
-/* Is a going to be cleaned before b?  ie. does a have fewer low bits
- * set than b? */
-static inline bool lesser_bitness(tag a, tag b) {
-    a ^= 0xffffffffffffffff;
-    b ^= 0xffffffffffffffff;
-    return (ffsll(a) < ffsll(b));
+static inline uint64_t hash_key(struct rzip_state * st, tag t) {
+    return ((uint64_t)bitness(t) << HASH_CHECK_BITS) |
+           ((mix_tag(t) >> (64 - bucket_bits(st) - HASH_CHECK_BITS)) & HASH_CHECK_MASK);
 }
 
-/* If hash bucket is taken, we spill into next bucket(s).  Secondary hashing
-   works better in theory, but modern caches make this 20% faster. */
-static void insert_hash(struct rzip_state * st, tag t, i64 offset) {
-    i64 h, victim_h = 0, round = 0;
-    /* If we need to kill one, this will be it. */
-    static i64 victim_round = 0;
-    struct hash_entry * he;
+static inline uint64_t he_key(struct hash_entry * he) { return he->e & HASH_KEY_MASK; }
+static inline i64 he_offset(struct hash_entry * he) { return he->e >> HASH_KEY_BITS; }
+static inline unsigned he_bitness(struct hash_entry * he) { return he_key(he) >> HASH_CHECK_BITS; }
+
+static inline void prefetch_bucket(struct rzip_state * hs, tag t) {
+    if ((t & hs->minimum_tag_mask) == hs->minimum_tag_mask) __builtin_prefetch(primary_bucket(hs, t), 1);
+}
+
+static inline tag increase_mask(tag tag_mask) {
+    /* Get more precise. */
+    return (tag_mask << 1) | 1;
+}
+
+/* Entries are never removed, so a bucket fills from the front and the first
+ * empty entry ends it.  Take a free entry if there is one, otherwise evict
+ * the entry with the fewest low bits set, the oldest of those first.  If we
+ * are no better than that, keep what is there.
+ *
+ * If we have lots of identical patterns, we end up with lots of the same
+ * hash number.  Past max_chain_len of them, replace the oldest. */
+static inline void insert_hash(struct rzip_state * st, tag t, i64 offset) {
+    struct hash_entry *bucket = primary_bucket(st, t), *victim = NULL, *same = NULL;
+    uint64_t key = hash_key(st, t);
+    unsigned b = key >> HASH_CHECK_BITS, vb;
+    unsigned nsame = 0;
+    int i;
 
-    h = primary_hash(st, t);
-    he = &st->hash_table[h];
-    while (!empty_hash(he)) {
-        /* If this due for cleaning anyway, just replace it:
-           rehashing might move it behind tag_clean_ptr. */
-        if (minimum_bitness(st, he->t)) {
-            st->hash_count--;
+    for (i = 0; i < HASH_WAYS; i++) {
+        struct hash_entry * he = &bucket[i];
+
+        if (empty_hash(he)) {
+            victim = he;
             break;
         }
-        /* If we are better than current occupant, we can't
-           jump over it: it will be cleaned before us, and
-           noone would then find us in the hash table.  Rehash
-           it, then take its place. */
-        if (lesser_bitness(he->t, t)) {
-            insert_hash(st, he->t, he->offset);
-            break;
+        if (he_key(he) == key) {
+            if (!same || he_offset(he) < he_offset(same)) same = he;
+            nsame++;
         }
+        if (!victim || he_bitness(he) < he_bitness(victim) ||
+            (he_bitness(he) == he_bitness(victim) && he_offset(he) < he_offset(victim)))
+            victim = he;
+    }
 
-        /* If we have lots of identical patterns, we end up
-           with lots of the same hash number.  Discard random. */
-        if (he->t == t) {
-            if (round == victim_round) victim_h = h;
-            if (++round == st->level->max_chain_len) {
-                h = victim_h;
-                he = &st->hash_table[h];
-                st->hash_count--;
-                victim_round++;
-                if (victim_round == st->level->max_chain_len) victim_round = 0;
-                break;
-            }
-        }
+    if (nsame >= st->level->max_chain_len)
+        victim = same;
+    else if (!empty_hash(victim) && he_bitness(victim) >= b)
+        return;
 
-        h++;
-        h &= ((1 << st->hash_bits) - 1);
-        he = &st->hash_table[h];
+    if (!empty_hash(victim)) {
+        vb = he_bitness(victim);
+        st->bitness_count[vb]--;
+        if (vb >= bitness(st->minimum_tag_mask)) st->hash_count--;
     }
-
-    he->t = t;
-    he->offset = offset;
+    st->bitness_count[b]++;
+    st->hash_count++;
+    victim->e = ((uint64_t)offset << HASH_KEY_BITS) | key;
 }
 
-/* Eliminate one hash entry with minimum number of lower bits set.
+/* Stop inserting tags with the minimum number of lower bits set, which
+   leaves the entries that have them as the victims of their buckets.
    Returns tag requirement for any new entries. */
-static inline tag clean_one_from_hash(rzip_control * control, struct rzip_state * st) {
-    struct hash_entry * he;
-    tag better_than_min;
+static inline tag raise_tag_mask(rzip_control * control, struct rzip_state * st) {
+    unsigned min_bitness = bitness(st->minimum_tag_mask);
 
-again:
-    better_than_min = increase_mask(st->minimum_tag_mask);
-    if (!st->tag_clean_ptr) print_maxverbose("Starting sweep for mask %'u\n", (unsigned int)st->minimum_tag_mask);
-
-    for (; st->tag_clean_ptr < (1U << st->hash_bits); st->tag_clean_ptr++) {
-        he = &st->hash_table[st->tag_clean_ptr];
-        if (empty_hash(he)) continue;
-        if ((he->t & better_than_min) != better_than_min) {
-            he->offset = 0;
-            he->t = 0;
-            st->hash_count--;
-            return better_than_min;
-        }
+    if (likely(min_bitness < HASH_MAX_BITNESS)) {
+        st->hash_count -= st->bitness_count[min_bitness];
+        st->minimum_tag_mask = increase_mask(st->minimum_tag_mask);
+        print_maxverbose("Raising tag mask to %'u\n", (unsigned int)st->minimum_tag_mask);
     }
+    return st->minimum_tag_mask;
+}
+
+/* Start an empty hash table for a new search. */
+static void reset_hash(struct rzip_state * st, tag tag_mask) {
+    memset(st->hash_table, 0, sizeof(st->hash_table[0]) * (1 << st->hash_bits));
+    memset(st->bitness_count, 0, sizeof(st->bitness_count));
+    st->minimum_tag_mask = tag_mask;
+    st->hash_count = 0;
+}
 
-    /* We hit the end: everthing in hash satisfies the better mask. */
-    st->minimum_tag_mask = better_than_min;
-    st->tag_clean_ptr = 0;
-    goto again;
+/* Allocate a table of at least hashsize entries, in whole cache-line sized
+   buckets. */
+static void alloc_hash(rzip_control * control, struct rzip_state * st, i64 hashsize) {
+    for (st->hash_bits = HASH_WAYS_BITS; (1U << st->hash_bits) < hashsize; st->hash_bits++)
+        ;
+
+    /* 75% of entries at or above the tag mask at max. */
+    st->hash_limit = (1 << st->hash_bits) / 4 * 3;
+    if (unlikely(posix_memalign((void **)&st->hash_table, sizeof(st->hash_table[0]) * HASH_WAYS,
+                                sizeof(st->hash_table[0]) * (1 << st->hash_bits))))
+        fatal("Failed to allocate hash table\n");
 }
 
-static void single_next_tag(rzip_control * control, struct rzip_state * st, i64 p, tag * t) {
+static inline void single_next_tag(rzip_control * control, struct rzip_state * st, i64 p, tag * t) {
     uchar u;
 
     u = control->sb.buf_low[p - 1];
@@ -336,7 +608,7 @@ static void single_next_tag(rzip_control * control, struct rzip_state * st, i64
     *t ^= st->hash_index[u];
 }
 
-static void sliding_next_tag(rzip_control * control, struct rzip_state * st, i64 p, tag * t) {
+static inline void sliding_next_tag(rzip_control * control, struct rzip_state * st, i64 p, tag * t) {
     uchar * u;
 
     u = sliding_get_sb(control, p - 1);
@@ -345,7 +617,7 @@ static void sliding_next_tag(rzip_control * control, struct rzip_state * st, i64
     *t ^= st->hash_index[*u];
 }
 
-static tag single_full_tag(rzip_control * control, struct rzip_state * st, i64 p) {
+static inline tag single_full_tag(rzip_control * control, struct rzip_state * st, i64 p) {
     tag ret = 0;
     int i;
     uchar u;
@@ -357,7 +629,7 @@ static tag single_full_tag(rzip_control * control, struct rzip_state * st, i64 p
     return ret;
 }
 
-static tag sliding_full_tag(rzip_control * control, struct rzip_state * st, i64 p) {
+static inline tag sliding_full_tag(rzip_control * control, struct rzip_state * st, i64 p) {
     tag ret = 0;
     int i;
     uchar * u;
@@ -369,172 +641,296 @@ static tag sliding_full_tag(rzip_control * control, struct rzip_state * st, i64
     return ret;
 }
 
-static i64 single_match_len(rzip_control * control, struct rzip_state * st, i64 p0, i64 op, i64 end, i64 * rev) {
-    i64 p, len;
+/* Count the equal bytes at the start of a and b, looking at no more than n.
+ * Whole vectors are compared at a time and the first mismatch is found with
+ * ctz on the inverted comparison mask. What is left at the edge of the range
+ * is compared one byte at a time. */
+static inline i64 match_fwd(const uchar * a, const uchar * b, i64 n) {
+    i64 i = 0;
+
+#ifdef __AVX512BW__
+    for (; i + 64 <= n; i += 64) {
+        uint64_t m = ~_mm512_cmpeq_epi8_mask(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+        if (m) return i + __builtin_ctzll(m);
+    }
+#endif
+#ifdef __AVX2__
+    for (; i + 32 <= n; i += 32) {
+        uint32_t m = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                                                       _mm256_loadu_si256((const __m256i *)(b + i))));
+        if (m) return i + __builtin_ctz(m);
+    }
+#endif
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        uint32_t m = 0xFFFF ^ _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                                               _mm_loadu_si128((const __m128i *)(b + i))));
+        if (m) return i + __builtin_ctz(m);
+    }
+#endif
+    while (i < n && a[i] == b[i]) i++;
+    return i;
+}
 
-    if (op >= p0) return 0;
+/* Same as match_fwd, but count the equal bytes right before a and b going
+ * backwards. The highest mismatching lane is found with clz instead. */
+static inline i64 match_bwd(const uchar * a, const uchar * b, i64 n) {
+    i64 i = 0;
 
-    p = p0;
-    while (p < end && control->sb.buf_low[p] == control->sb.buf_low[op]) {
-        p++;
-        op++;
+#ifdef __AVX512BW__
+    for (; i + 64 <= n; i += 64) {
+        uint64_t m = ~_mm512_cmpeq_epi8_mask(_mm512_loadu_si512(a - i - 64), _mm512_loadu_si512(b - i - 64));
+        if (m) return i + __builtin_clzll(m);
     }
-    len = p - p0;
-    p = p0;
-    op -= len;
+#endif
+#ifdef __AVX2__
+    for (; i + 32 <= n; i += 32) {
+        uint32_t m = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)(a - i - 32)), _mm256_loadu_si256((const __m256i *)(b - i - 32))));
+        if (m) return i + __builtin_clz(m);
+    }
+#endif
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        uint32_t m = 0xFFFF ^ _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a - i - 16)),
+                                                               _mm_loadu_si128((const __m128i *)(b - i - 16))));
+        if (m) return i + __builtin_clz(m) - 16;
+    }
+#endif
+    while (i < n && a[-i - 1] == b[-i - 1]) i++;
+    return i;
+}
 
-    end = MAX(0, st->last_match);
+static inline i64 single_match_len(rzip_control * control, struct rzip_state * st, i64 p0, i64 op, i64 end, i64 * rev) {
+    uchar * buf = control->sb.buf_low;
+    i64 len;
 
-    while (p > end && op > 0 && control->sb.buf_low[op - 1] == control->sb.buf_low[p - 1]) {
-        op--;
-        p--;
-    }
+    if (op >= p0) return 0;
+
+    len = match_fwd(buf + p0, buf + op, end - p0);
 
-    len += * rev = p0 - p;
+    /* Extend backwards, but never past the last match or the start */
+    end = MAX(0, st->last_match);
+
+    len += * rev = match_bwd(buf + p0, buf + op, MIN(p0 - end, op));
     if (len < MINIMUM_MATCH) return 0;
 
     return len;
 }
 
-static i64 sliding_match_len(rzip_control * control, struct rzip_state * st, i64 p0, i64 op, i64 end, i64 * rev) {
-    i64 p, len;
+/* Compares whole spans of p0 and op that are mapped contiguously, fetching
+ * the next spans only when one runs out. */
+static inline i64 sliding_match_len(rzip_control * control, struct rzip_state * st, i64 p0, i64 op, i64 end,
+                                    i64 * rev) {
+    i64 len = 0, back = 0, low, n, m, na, nb, unused;
+    uchar *a, *b;
 
     if (op >= p0) return 0;
 
-    p = p0;
-    while (p < end && *sliding_get_sb(control, p) == *sliding_get_sb(control, op)) {
-        p++;
-        op++;
+    while (p0 + len < end) {
+        a = sliding_get_span(control, p0 + len, &unused, &na);
+        b = sliding_get_span(control, op + len, &unused, &nb);
+        n = MIN(MIN(na, nb), end - p0 - len);
+        m = match_fwd(a, b, n);
+        len += m;
+        if (m < n) break;
     }
-    len = p - p0;
-    p = p0;
-    op -= len;
 
-    end = MAX(0, st->last_match);
+    low = MAX(0, st->last_match);
 
-    while (p > end && op > 0 && *sliding_get_sb(control, op - 1) == *sliding_get_sb(control, p - 1)) {
-        op--;
-        p--;
+    while (p0 - back > low && op - back > 0) {
+        a = sliding_get_span(control, p0 - back - 1, &na, &unused);
+        b = sliding_get_span(control, op - back - 1, &nb, &unused);
+        n = MIN(MIN(na, nb) + 1, MIN(p0 - back - low, op - back));
+        m = match_bwd(a + 1, b + 1, n);
+        back += m;
+        if (m < n) break;
     }
 
-    len += * rev = p0 - p;
+    len += * rev = back;
     if (len < MINIMUM_MATCH) return 0;
 
     return len;
 }
 
-static inline i64 find_best_match(rzip_control * control, struct rzip_state * st, tag t, i64 p, i64 end, i64 * offset,
-                                  i64 * reverse) {
-    struct hash_entry * he;
+static __always_inline void next_tag(rzip_control * control, struct rzip_state * st, i64 p, tag * t,
+                                     const bool sliding) {
+    if (sliding)
+        sliding_next_tag(control, st, p, t);
+    else
+        single_next_tag(control, st, p, t);
+}
+
+static __always_inline tag full_tag(rzip_control * control, struct rzip_state * st, i64 p, const bool sliding) {
+    if (sliding) return sliding_full_tag(control, st, p);
+    return single_full_tag(control, st, p);
+}
+
+static __always_inline i64 match_len(rzip_control * control, struct rzip_state * st, i64 p0, i64 op, i64 end,
+                                     i64 * rev, const bool sliding) {
+    if (sliding) return sliding_match_len(control, st, p0, op, end, rev);
+    return single_match_len(control, st, p0, op, end, rev);
+}
+
+/* Look tag t up in the hash table of hs. This is st itself, except for the
+ * parallel search where a segment also probes the tables of the segments
+ * before it. */
+static __always_inline i64 find_best_match(rzip_control * control, struct rzip_state * st, struct rzip_state * hs,
+                                           tag t, i64 p, i64 end, i64 * offset, i64 * reverse, const bool sliding) {
+    struct hash_entry * bucket = primary_bucket(hs, t);
+    uint64_t key = hash_key(hs, t);
     i64 length = 0;
     i64 rev;
-    i64 h;
+    int i;
 
     rev = 0;
     *reverse = 0;
 
-    /* Could optimise: if lesser goodness, can stop search.  But
-     * chains are usually short anyway. */
-    h = primary_hash(st, t);
-    he = &st->hash_table[h];
-    while (!empty_hash(he)) {
+    for (i = 0; i < HASH_WAYS; i++) {
+        struct hash_entry * he = &bucket[i];
         i64 mlen;
 
-        if (t == he->t) {
-            mlen = control->match_len(control, st, p, he->offset, end, &rev);
+        if (empty_hash(he)) break;
+
+        if (he_key(he) == key) {
+            mlen = match_len(control, st, p, he_offset(he), end, &rev, sliding);
             if (mlen) {
                 if (mlen > length) {
                     length = mlen;
-                    (*offset) = he->offset - rev;
+                    (*offset) = he_offset(he) - rev;
                     (*reverse) = rev;
                 }
                 st->stats.tag_hits++;
             } else
                 st->stats.tag_misses++;
         }
-
-        h++;
-        h &= ((1 << st->hash_bits) - 1);
-        he = &st->hash_table[h];
     }
 
     return length;
 }
 
+/* Entries do not record their primary bucket, so only occupancy is shown. */
 static void show_distrib(rzip_control * control, struct rzip_state * st) {
     struct hash_entry * he;
-    i64 primary = 0;
-    i64 total = 0;
+    i64 total = 0, counted = 0;
     i64 i;
 
     for (i = 0; i < (1U << st->hash_bits); i++) {
         he = &st->hash_table[i];
         if (empty_hash(he)) continue;
         total++;
-        if (primary_hash(st, he->t) == i) primary++;
     }
+    for (i = 0; i <= HASH_MAX_BITNESS; i++) counted += st->bitness_count[i];
 
-    if (total != st->hash_count) print_err("WARNING: hash_count says total %'" PRId64 "\n", st->hash_count);
+    if (total != counted) print_err("WARNING: bitness counts say total %'" PRId64 "\n", counted);
 
     if (!total)
         print_output("0 total hashes\n");
     else {
-        print_output("%'" PRId64 " total hashes -- %'" PRId64 " in primary bucket (%-2.3f%%)\n", total, primary,
-                     primary * 100.0 / total);
+        print_output("%'" PRId64 " total hashes -- %'" PRId64 " current, %-2.3f%% of table in use\n", total,
+                     st->hash_count, total * 100.0 / (1U << st->hash_bits));
     }
 }
 
-/* Perform all checksumming in a separate thread to speed up the hash search. */
-static void * cksumthread(void * data) {
-    rzip_control * control = (rzip_control *)data;
+static inline bool far_anchor(tag t) { return ((t >> 24) & FAR_ANCHOR_MASK) == FAR_ANCHOR_MASK; }
+
+/* Length of the match between p in this chunk and absolute offset q in an
+ * earlier one, read back from the input file.  The match does not run past
+ * the start of this chunk, so runzip finds all of it already written out. */
+static i64 far_match_len(rzip_control * control, struct rzip_state * st, i64 p, i64 q, i64 end, i64 * rev,
+                         const bool sliding) {
+    uchar *old = st->far_buf, *cur = st->far_buf + FAR_BLOCK;
+    i64 limit = control->sb.orig_offset, low = MAX(0, st->last_match);
+    i64 len = 0, back = 0, want, n, m;
+
+    for (want = FAR_MIN_READ; p + len < end && q + len < limit; want = MIN(want * 2, FAR_BLOCK)) {
+        n = MIN(want, MIN(end - p - len, limit - q - len));
+        if (unlikely(pread(st->fd_in, old, n, q + len) != n)) break;
+        do_mcpy(control, cur, p + len, n, sliding);
+        m = match_fwd(cur, old, n);
+        len += m;
+        if (m < n) break;
+    }
+    if (len < MINIMUM_MATCH) return 0;
 
-    pthread_detach(pthread_self());
+    for (want = FAR_MIN_READ; p - back > low && q - back > 0; want = MIN(want * 2, FAR_BLOCK)) {
+        n = MIN(want, MIN(p - back - low, q - back));
+        if (unlikely(pread(st->fd_in, old, n, q - back - n) != n)) break;
+        do_mcpy(control, cur, p - back - n, n, sliding);
+        m = match_bwd(cur + n, old + n, n);
+        back += m;
+        if (m < n) break;
+    }
 
-    //	*control->checksum.cksum = CrcUpdate(*control->checksum.cksum, control->checksum.buf, control->checksum.len);
-    gcry_md_write(control->crc_handle, control->checksum.buf, control->checksum.len);
-    if (HAS_HASH) gcry_md_write(control->hash_handle, control->checksum.buf, control->checksum.len);
-    dealloc(control->checksum.buf);
-    cksem_post(control, &control->cksumsem);
-    return NULL;
+    if (len + back < FAR_MIN_MATCH) return 0;
+    *rev = back;
+    return len + back;
+}
+
+/* Look anchor t up among the earlier chunks, then remember it at p.  The
+ * index is direct mapped: a newer anchor simply replaces the older one. */
+static i64 far_match(rzip_control * control, struct rzip_state * st, tag t, i64 p, i64 end, i64 * offset,
+                     i64 * reverse, const bool sliding) {
+    uint64_t h = mix_tag(t), *fe = &st->far_index[h >> (64 - st->far_bits)];
+    uint64_t check = (h >> (64 - st->far_bits - HASH_KEY_BITS)) & HASH_KEY_MASK;
+    i64 here = control->sb.orig_offset + p, q, len = 0;
+
+    *reverse = 0;
+    q = *fe >> HASH_KEY_BITS;
+    if (*fe && (*fe & HASH_KEY_MASK) == check && q < control->sb.orig_offset) {
+        len = far_match_len(control, st, p, q, end, reverse, sliding);
+        *offset = q - *reverse;
+    }
+    if (likely(here < MAX_HASH_OFFSET)) *fe = ((uint64_t)here << HASH_KEY_BITS) | check;
+    return len;
 }
 
-static inline void cksum_update(rzip_control * control) {
-    pthread_t thread;
+/* Hand the range of len bytes from limit on to the checksum thread and
+ * return where the checksum got to. With the sliding buffer only what the
+ * low buffer maps can be handed over, anything else is copied and hashed
+ * right here once the thread has caught up. */
+static i64 cksum_queue(rzip_control * control, struct rzip_state * st, i64 limit, i64 len, const bool sliding) {
+    struct sliding_buffer * sb = &control->sb;
+    i64 end = MIN(limit + len, st->chunk_size);
+    uchar * buf;
+
+    if (limit >= sb->offset_low && limit < sb->offset_low + sb->size_low) {
+        end = MIN(end, sb->offset_low + sb->size_low);
+        return cksum_push(control, sb->buf_low + limit - sb->offset_low, end - limit) ? end : limit;
+    }
 
-    create_pthread(control, &thread, NULL, cksumthread, control);
+    end = MIN(end, limit + control->page_size);
+    buf = malloc(end - limit);
+    if (unlikely(!buf)) fatal("Failed to malloc ckbuf in hash_search\n");
+    do_mcpy(control, buf, limit, end - limit, sliding);
+    cksum_drain(control);
+    gcry_md_write(control->crc_handle, buf, end - limit);
+    if (HAS_HASH) file_hash_write(control, &control->hash_handle, buf, end - limit);
+    dealloc(buf);
+    return end;
 }
 
-static inline void hash_search(rzip_control * control, struct rzip_state * st, double pct_base, double pct_multiple) {
-    i64 cksum_limit = 0, p, end, cksum_chunks, cksum_remains, i;
-    tag t = 0, tag_mask = (1 << st->level->initial_freq) - 1;
+static __always_inline void hash_search(rzip_control * control, struct rzip_state * st, const bool sliding) {
+    i64 cksum_limit = 0, p, pa, end, cksum_chunks, cksum_remains, i, next_progress = PROGRESS_BATCH;
+    tag t = 0, ta, tag_mask = (1 << st->level->initial_freq) - 1;
     struct sliding_buffer * sb = &control->sb;
-    int lastpct = 0, last_chunkpct = 0;
     struct {
         i64 p;
         i64 ofs;
         i64 len;
+        bool far;
     } current;
 
-    if (st->hash_table)
-        memset(st->hash_table, 0, sizeof(st->hash_table[0]) * (1 << st->hash_bits));
-    else {
+    if (!st->hash_table) {
         i64 hashsize = st->level->mb_used * (ONE_MB / sizeof(st->hash_table[0]));
-        for (st->hash_bits = 0; (1U << st->hash_bits) < hashsize; st->hash_bits++)
-            ;
 
+        alloc_hash(control, st, hashsize);
         print_maxverbose("hashsize = %'" PRId64 ".  bits = %'" PRId64 ". %'" PRIu32 "MB\n", hashsize, st->hash_bits,
                          st->level->mb_used);
-
-        /* 66% full at max. */
-        st->hash_limit = (1 << st->hash_bits) / 3 * 2;
-        st->hash_table = calloc(sizeof(st->hash_table[0]), (1 << st->hash_bits));
-        if (unlikely(!st->hash_table)) fatal("Failed to allocate hash table in hash_search\n");
     }
 
-    st->minimum_tag_mask = tag_mask;
-    st->tag_clean_ptr = 0;
+    reset_hash(st, tag_mask);
     st->cksum = 0;
-    st->hash_count = 0;
 
     p = 0;
     end = st->chunk_size - MINIMUM_MATCH;
@@ -542,85 +938,99 @@ static inline void hash_search(rzip_control * control, struct rzip_state * st, d
     current.len = 0;
     current.p = p;
     current.ofs = 0;
+    current.far = false;
 
-    if (likely(end > 0)) t = control->full_tag(control, st, p);
+    if (likely(end > 0)) t = full_tag(control, st, p, sliding);
+    pa = p;
+    ta = t;
 
     while (p < end) {
         i64 reverse, mlen, offset;
 
-        sb->offset_search = ++p;
-        if (unlikely(sb->offset_search > sb->offset_low + sb->size_low)) remap_low_sb(control, &control->sb);
-
-        if (unlikely(p % 128 == 0 && st->chunk_size)) {
-            i64 chunk_pct;
-            int pct;
-
-            pct = pct_base + (pct_multiple * (100.0 * p) / st->chunk_size);
-            chunk_pct = p * 100 / end;
-            if (pct != lastpct || chunk_pct != last_chunkpct) {
-                if (!STDIN || st->stdin_eof) print_progress("Total: %2d%%  ", pct);
-                print_progress("Chunk: %2d%%\r", chunk_pct);
-                /* mrzip library callback code removed */
-                lastpct = pct;
-                last_chunkpct = chunk_pct;
+        /* Prefetch buckets ahead, but not with the sliding buffer where
+         * looking ahead could make it remap */
+        ++p;
+        if (sliding) {
+            __atomic_store_n(&sb->offset_search, p, __ATOMIC_RELAXED);
+            if (unlikely(p > sb->offset_low + sb->size_low)) remap_low_sb(control, &control->sb);
+        } else {
+            while (pa < MIN(p + HASH_PREFETCH_DISTANCE, end)) {
+                single_next_tag(control, st, ++pa, &ta);
+                prefetch_bucket(st, ta);
             }
         }
 
-        control->next_tag(control, st, p, &t);
+        if (unlikely(p >= next_progress)) {
+            /* Let the prefetch thread and the progress reporter know where we are */
+            if (!sliding) __atomic_store_n(&sb->offset_search, p, __ATOMIC_RELAXED);
+            progress_set(control, p);
+            next_progress = p + PROGRESS_BATCH;
+        }
+
+        next_tag(control, st, p, &t, sliding);
+
+        if (st->far_index && unlikely(far_anchor(t))) {
+            mlen = far_match(control, st, t, p, end, &offset, &reverse, sliding);
+            if (mlen > current.len) {
+                current.p = p - reverse;
+                current.len = mlen;
+                current.ofs = offset;
+                current.far = true;
+            }
+        }
 
         /* Don't look for a match if there are no tags with
            this number of bits in the hash table. */
         if ((t & st->minimum_tag_mask) != st->minimum_tag_mask) continue;
 
         offset = 0;
-        mlen = find_best_match(control, st, t, p, end, &offset, &reverse);
+        mlen = find_best_match(control, st, st, t, p, end, &offset, &reverse, sliding);
 
         /* Only insert occasionally into hash. */
         if ((t & tag_mask) == tag_mask) {
             st->stats.inserts++;
-            st->hash_count++;
             insert_hash(st, t, p);
-            if (st->hash_count > st->hash_limit) tag_mask = clean_one_from_hash(control, st);
+            if (st->hash_count > st->hash_limit) tag_mask = raise_tag_mask(control, st);
         }
 
         if (mlen > current.len) {
             current.p = p - reverse;
             current.len = mlen;
             current.ofs = offset;
+            current.far = false;
         }
 
         if ((current.len >= GREAT_MATCH || p >= current.p + MINIMUM_MATCH) && current.len >= MINIMUM_MATCH) {
-            if (st->last_match < current.p) put_literal(control, st, st->last_match, current.p);
-            put_match(control, st, current.p, current.ofs, current.len);
+            if (st->last_match < current.p) put_literal(control, st, st->last_match, current.p, sliding);
+            if (current.far)
+                put_far_match(control, st, current.p, current.ofs, current.len);
+            else
+                put_match(control, st, current.p, current.ofs, current.len);
             st->last_match = current.p + current.len;
             current.p = p = st->last_match;
             current.len = 0;
-            t = control->full_tag(control, st, p);
+            t = full_tag(control, st, p, sliding);
+            pa = p;
+            ta = t;
         }
 
-        if (p > cksum_limit) {
-            /* We lock the mutex here and unlock it in the
-             * cksumthread. This lock protects all the data in
-             * control->checksum.
-             */
-            cksem_wait(control, &control->cksumsem);
-            control->checksum.len = MIN(st->chunk_size - p, control->page_size);
-            control->checksum.buf = malloc(control->checksum.len);
-            if (unlikely(!control->checksum.buf)) fatal("Failed to malloc ckbuf in hash_search\n");
-            control->do_mcpy(control, control->checksum.buf, cksum_limit, control->checksum.len);
-            //			control->checksum.cksum = &st->cksum;
-            cksum_limit += control->checksum.len;
-            cksum_update(control);
-        }
+        /* If the checksum thread is behind, try again further on */
+        if (p > cksum_limit) cksum_limit = cksum_queue(control, st, cksum_limit, CKSUM_BATCH, sliding);
     }
 
     if (MAX_VERBOSE) show_distrib(control, st);
 
-    if (st->last_match < st->chunk_size) put_literal(control, st, st->last_match, st->chunk_size);
+    if (st->last_match < st->chunk_size) put_literal(control, st, st->last_match, st->chunk_size, sliding);
+
+    /* Hand over the rest of what the buffer maps in one go */
+    cksum_drain(control);
+    if (st->chunk_size > cksum_limit)
+        cksum_limit = cksum_queue(control, st, cksum_limit, st->chunk_size - cksum_limit, sliding);
+    cksum_drain(control);
 
     if (st->chunk_size > cksum_limit) {
         i64 cksum_len = control->maxram;
-        void * buf;
+        uchar * buf;
 
         while (42) {
             round_to_page(&cksum_len);
@@ -633,39 +1043,289 @@ static inline void hash_search(rzip_control * control, struct rzip_state * st, d
             if (cksum_len < control->page_size) fatal("Failed to malloc any ram for checksum ckbuf\n");
         }
 
-        /* Compute checksum. If the entire chunk is longer than maxram,
-         * do it "per-partes" */
-        cksem_wait(control, &control->cksumsem);
-        control->checksum.buf = buf;
-        control->checksum.len = st->chunk_size - cksum_limit;
-        cksum_chunks = control->checksum.len / cksum_len;
-        cksum_remains = control->checksum.len % cksum_len;
+        /* Compute checksum of what is left outside the low buffer. If it
+         * is longer than maxram, do it "per-partes" */
+        cksum_chunks = (st->chunk_size - cksum_limit) / cksum_len;
+        cksum_remains = (st->chunk_size - cksum_limit) % cksum_len;
 
         for (i = 0; i < cksum_chunks; i++) {
-            control->do_mcpy(control, control->checksum.buf, cksum_limit, cksum_len);
+            do_mcpy(control, buf, cksum_limit, cksum_len, sliding);
             cksum_limit += cksum_len;
-            //			st->cksum = CrcUpdate(st->cksum, control->checksum.buf, cksum_len);
-            gcry_md_write(control->crc_handle, control->checksum.buf, cksum_len);
-            if (HAS_HASH) gcry_md_write(control->hash_handle, control->checksum.buf, cksum_len);
+            gcry_md_write(control->crc_handle, buf, cksum_len);
+            if (HAS_HASH) file_hash_write(control, &control->hash_handle, buf, cksum_len);
         }
         /* Process end of the checksum buffer */
-        control->do_mcpy(control, control->checksum.buf, cksum_limit, cksum_remains);
-        //		st->cksum = CrcUpdate(st->cksum, control->checksum.buf, cksum_remains);
-        gcry_md_write(control->crc_handle, control->checksum.buf, cksum_remains);
-        if (HAS_HASH) gcry_md_write(control->hash_handle, control->checksum.buf, cksum_remains);
-        dealloc(control->checksum.buf);
-        cksem_post(control, &control->cksumsem);
-    } else {
-        cksem_wait(control, &control->cksumsem);
-        cksem_post(control, &control->cksumsem);
+        do_mcpy(control, buf, cksum_limit, cksum_remains, sliding);
+        gcry_md_write(control->crc_handle, buf, cksum_remains);
+        if (HAS_HASH) file_hash_write(control, &control->hash_handle, buf, cksum_remains);
+        dealloc(buf);
     }
     memcpy(&st->cksum, gcry_md_read(control->crc_handle, *control->crc_gcode), *control->crc_len);
 
-    put_literal(control, st, 0, 0);
-    put_u32(control, st->ss, st->cksum);
+    put_literal(control, st, 0, 0, sliding);
+    put_u32(control, st, st->cksum);
+    flush_tokens(control, st);
     gcry_md_reset(control->crc_handle);  // reset crc computation
 }
 
+/* The two hash search engines. rzip_chunk picks one for every chunk. */
+static void single_hash_search(rzip_control * control, struct rzip_state * st) {
+    hash_search(control, st, false);
+}
+
+static void sliding_hash_search(rzip_control * control, struct rzip_state * st) {
+    hash_search(control, st, true);
+}
+
+/* Parallel hash search. The chunk is split into segments and every segment
+ * gets a hash table of its own, together using as much ram as the single
+ * table of the serial search. First all tables are filled concurrently.
+ * Then every segment is searched concurrently against its own table and the
+ * (now read only) tables of the segments before it, so matches can reach
+ * back into any earlier part of the chunk. The matches found are kept in a
+ * list per segment and merged in order into the literal/match stream, with
+ * the start of matches overlapping what was already emitted cut off. Only
+ * used for chunks that fit in a single mmap. */
+struct rzip_segment {
+    rzip_control * control;
+    struct rzip_state st; /* private copy of the state with its own hash table */
+    struct rzip_segment * segs;
+    int no;
+    i64 start, end;
+    struct segment_match {
+        i64 p;
+        i64 ofs;
+        i64 len;
+    } * matches;
+    i64 num_matches, max_matches;
+};
+
+#define MIN_SEGMENT (16 * ONE_MB)
+
+static void * segment_fill(void * data) {
+    struct rzip_segment * seg = data;
+    rzip_control * control = seg->control;
+    struct rzip_state * st = &seg->st;
+    tag t, ta, tag_mask = (1 << st->level->initial_freq) - 1;
+    i64 p = seg->start, pa;
+
+    reset_hash(st, tag_mask);
+
+    ta = t = single_full_tag(control, st, p);
+    pa = p;
+    while (++p < seg->end) {
+        while (pa < MIN(p + HASH_PREFETCH_DISTANCE, seg->end)) {
+            single_next_tag(control, st, ++pa, &ta);
+            prefetch_bucket(st, ta);
+        }
+        single_next_tag(control, st, p, &t);
+        if ((t & tag_mask) == tag_mask) {
+            st->stats.inserts++;
+            insert_hash(st, t, p);
+            if (st->hash_count > st->hash_limit) tag_mask = raise_tag_mask(control, st);
+        }
+    }
+    return NULL;
+}
+
+static void add_segment_match(rzip_control * control, struct rzip_segment * seg, i64 p, i64 ofs, i64 len) {
+    if (seg->num_matches == seg->max_matches) {
+        struct segment_match * m;
+
+        seg->max_matches = seg->max_matches ? seg->max_matches * 2 : 1024;
+        m = realloc(seg->matches, seg->max_matches * sizeof(*m));
+        if (unlikely(!m)) fatal("Failed to realloc segment matches in add_segment_match\n");
+        seg->matches = m;
+    }
+    seg->matches[seg->num_matches].p = p;
+    seg->matches[seg->num_matches].ofs = ofs;
+    seg->matches[seg->num_matches].len = len;
+    seg->num_matches++;
+}
+
+static void * segment_search(void * data) {
+    struct rzip_segment * seg = data;
+    rzip_control * control = seg->control;
+    struct rzip_state * st = &seg->st;
+    i64 p = seg->start, pa, end = st->chunk_size - MINIMUM_MATCH, reported = p;
+    tag t, ta;
+    struct {
+        i64 p;
+        i64 ofs;
+        i64 len;
+    } current;
+
+    seg->num_matches = 0;
+    st->last_match = p;
+    current.len = 0;
+    current.p = p;
+    current.ofs = 0;
+
+    ta = t = single_full_tag(control, st, p);
+    pa = p;
+    while (p < seg->end) {
+        i64 reverse = 0, mlen = 0, offset = 0;
+        bool probed = false;
+        int i;
+
+        single_next_tag(control, st, ++p, &t);
+        while (pa < MIN(p + HASH_PREFETCH_DISTANCE, seg->end)) {
+            single_next_tag(control, st, ++pa, &ta);
+            for (i = seg->no; i >= 0; i--) prefetch_bucket(&seg->segs[i].st, ta);
+        }
+        if (unlikely(p >= reported + PROGRESS_BATCH)) {
+            progress_add(control, p - reported);
+            reported = p;
+        }
+
+        for (i = seg->no; i >= 0; i--) {
+            struct rzip_state * hs = &seg->segs[i].st;
+            i64 l, o, r;
+
+            if ((t & hs->minimum_tag_mask) != hs->minimum_tag_mask) continue;
+            probed = true;
+            l = find_best_match(control, st, hs, t, p, end, &o, &r, false);
+            if (l > mlen) {
+                mlen = l;
+                offset = o;
+                reverse = r;
+            }
+        }
+        if (!probed) continue;
+
+        if (mlen > current.len) {
+            current.p = p - reverse;
+            current.len = mlen;
+            current.ofs = offset;
+        }
+
+        if ((current.len >= GREAT_MATCH || p >= current.p + MINIMUM_MATCH) && current.len >= MINIMUM_MATCH) {
+            add_segment_match(control, seg, current.p, current.ofs, current.len);
+            st->last_match = current.p + current.len;
+            current.p = p = st->last_match;
+            current.len = 0;
+            if (p < seg->end) ta = t = single_full_tag(control, st, p);
+            pa = p;
+        }
+    }
+    /* A match still pending at the end of the segment is as good as any */
+    if (current.len >= MINIMUM_MATCH) add_segment_match(control, seg, current.p, current.ofs, current.len);
+    if (seg->end > reported) progress_add(control, seg->end - reported);
+    return NULL;
+}
+
+static void parallel_hash_search(rzip_control * control, struct rzip_state * st, int nsegs) {
+    struct rzip_segment * segs = st->segments;
+    pthread_t * threads;
+    i64 last = 0, seg_size, j;
+    int i;
+
+    threads = calloc(sizeof(pthread_t), nsegs);
+    if (unlikely(!threads)) fatal("Failed to calloc threads in parallel_hash_search\n");
+
+    /* The whole chunk is mapped so it can be hashed in one go meanwhile */
+    cksum_push(control, control->sb.buf_low, control->sb.orig_size);
+
+    seg_size = st->chunk_size / nsegs;
+    round_to_page(&seg_size);
+    for (i = 0; i < nsegs; i++) {
+        struct rzip_segment * seg = &segs[i];
+        struct hash_entry * hash_table = seg->st.hash_table;
+        char hash_bits = seg->st.hash_bits;
+        i64 hash_limit = seg->st.hash_limit;
+
+        seg->st = *st;
+        seg->st.hash_table = hash_table;
+        seg->st.hash_bits = hash_bits;
+        seg->st.hash_limit = hash_limit;
+        memset(&seg->st.stats, 0, sizeof(seg->st.stats));
+        seg->control = control;
+        seg->segs = segs;
+        seg->no = i;
+        seg->start = i * seg_size;
+        seg->end = i == nsegs - 1 ? st->chunk_size - MINIMUM_MATCH : (i + 1) * seg_size;
+        create_pthread(control, &threads[i], NULL, segment_fill, seg);
+    }
+    for (i = 0; i < nsegs; i++) join_pthread(control, threads[i], NULL);
+    print_maxverbose("Filled %'d segment hash tables\n", nsegs);
+
+    for (i = 0; i < nsegs; i++) create_pthread(control, &threads[i], NULL, segment_search, &segs[i]);
+
+    /* Merge the segments in order as soon as each of them is done */
+    for (i = 0; i < nsegs; i++) {
+        struct rzip_segment * seg = &segs[i];
+
+        join_pthread(control, threads[i], NULL);
+        for (j = 0; j < seg->num_matches; j++) {
+            struct segment_match m = seg->matches[j];
+
+            if (m.p + m.len <= last) continue;
+            if (m.p < last) {
+                i64 skip = last - m.p;
+
+                m.p += skip;
+                m.ofs += skip;
+                m.len -= skip;
+                if (m.len < MINIMUM_MATCH) continue;
+            }
+            if (last < m.p) put_literal(control, st, last, m.p, false);
+            put_match(control, st, m.p, m.ofs, m.len);
+            last = m.p + m.len;
+        }
+        st->stats.inserts += seg->st.stats.inserts;
+        st->stats.tag_hits += seg->st.stats.tag_hits;
+        st->stats.tag_misses += seg->st.stats.tag_misses;
+    }
+    dealloc(threads);
+
+    if (last < st->chunk_size) put_literal(control, st, last, st->chunk_size, false);
+
+    cksum_drain(control);
+    memcpy(&st->cksum, gcry_md_read(control->crc_handle, *control->crc_gcode), *control->crc_len);
+
+    put_literal(control, st, 0, 0, false);
+    put_u32(control, st, st->cksum);
+    flush_tokens(control, st);
+    gcry_md_reset(control->crc_handle);  // reset crc computation
+}
+
+/* How many segments to split this chunk into for parallel_hash_search, or 0
+ * to use the serial search. Allocates the segment hash tables on first use,
+ * splitting the memory of the level between control->rzip_threads tables. */
+static int prepare_segments(rzip_control * control, struct rzip_state * st) {
+    int i, nsegs = control->rzip_threads;
+
+    if (nsegs < 2) return 0;
+    if (st->chunk_size / MIN_SEGMENT < nsegs) nsegs = st->chunk_size / MIN_SEGMENT;
+    if (nsegs < 2) return 0;
+
+    if (!st->segments) {
+        i64 hashsize = st->level->mb_used * (ONE_MB / sizeof(struct hash_entry)) / control->rzip_threads;
+
+        st->segments = calloc(sizeof(struct rzip_segment), control->rzip_threads);
+        if (unlikely(!st->segments)) fatal("Failed to calloc segments in prepare_segments\n");
+        for (i = 0; i < control->rzip_threads; i++) {
+            struct rzip_state * ss = &st->segments[i].st;
+
+            alloc_hash(control, ss, hashsize);
+        }
+        print_maxverbose("Parallel rzip: %'d segment hash tables of %'" PRId64 " bits\n", control->rzip_threads,
+                         (i64)st->segments[0].st.hash_bits);
+    }
+    return nsegs;
+}
+
+static void clear_segments(rzip_control * control, struct rzip_state * st) {
+    int i;
+
+    if (!st->segments) return;
+    for (i = 0; i < control->rzip_threads; i++) {
+        dealloc(st->segments[i].st.hash_table);
+        dealloc(st->segments[i].matches);
+    }
+    dealloc(st->segments);
+}
+
 static inline void init_hash_indexes(struct rzip_state * st) {
     int i;
 
@@ -693,55 +1353,96 @@ static inline void * fake_mremap(void * old_address, size_t old_size, size_t new
 }
 #endif
 
-/* stdin is not file backed so we have to emulate the mmap by mapping
- * anonymous ram and reading stdin into it. It means the maximum ram
- * we can use will be less but we will already have determined this in
- * rzip_chunk */
-static inline void mmap_stdin(rzip_control * control, uchar * buf, struct rzip_state * st) {
-    i64 len = st->chunk_size;
-    uchar * offset_buf = buf;
-    ssize_t ret;
-    i64 total;
-
-    total = 0;
+/* Read up to len bytes of stdin into buf, stopping early only at EOF */
+static i64 read_stdin(rzip_control * control, uchar * buf, i64 len, bool * eof) {
+    i64 total = 0;
+
     while (len > 0) {
-        ret = MIN(len, one_g);
-        ret = read(fileno(control->inFILE), offset_buf, (size_t)ret);
-        if (unlikely(ret < 0)) fatal("Failed to read in mmap_stdin\n");
-        total += ret;
+        ssize_t ret = read(fileno(control->inFILE), buf + total, (size_t)MIN(len, one_g));
+
+        if (unlikely(ret < 0)) fatal("Failed to read stdin\n");
         if (ret == 0) {
-            /* Should be EOF */
-            print_maxverbose("Shrinking chunk to %'" PRId64 "\n", total);
-            if (likely(total)) {
-                buf = (uchar *)mremap(buf, st->chunk_size, total, 0);
-                st->mmap_size = st->chunk_size = total;
-            } else {
-                /* Empty file */
-                buf = (uchar *)mremap(buf, st->chunk_size, control->page_size, 0);
-                st->mmap_size = control->page_size;
-                st->chunk_size = 0;
-            }
-            if (unlikely(buf == MAP_FAILED)) fatal("Failed to remap to smaller buf in mmap_stdin\n");
-            control->eof = st->stdin_eof = 1;
+            *eof = true;
             break;
         }
-        offset_buf += ret;
+        total += ret;
         len -= ret;
     }
+    return total;
+}
+
+static void * read_ahead_thread(void * data) {
+    struct read_ahead * ra = data;
+    rzip_control * control = ra->control;
+
+    ra->len = read_stdin(control, ra->buf, ra->want, &ra->eof);
+    return NULL;
+}
+
+/* Start reading the next stdin chunk while this one is compressed. Only
+ * half a window is read ahead: those pages stay resident next to the window
+ * being compressed, and the rest is read once the chunk gets its turn.
+ * Without the memory for a second mapping stdin is just read later. */
+static void start_read_ahead(rzip_control * control, struct rzip_state * st) {
+    struct read_ahead * ra = &st->ahead;
+
+    ra->buf = mmap(NULL, st->mmap_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ra->buf == MAP_FAILED) {
+        ra->buf = NULL;
+        return;
+    }
+    advise_input(ra->buf, st->mmap_size, 0);
+    ra->size = st->mmap_size;
+    ra->want = st->mmap_size / 2;
+    round_to_page(&ra->want);
+    ra->len = 0;
+    ra->eof = false;
+    ra->control = control;
+    create_pthread(control, &ra->thread, NULL, read_ahead_thread, ra);
+}
+
+/* Wait for the read ahead and take its buffer as the new low buffer */
+static uchar * take_read_ahead(rzip_control * control, struct rzip_state * st) {
+    struct read_ahead * ra = &st->ahead;
+    uchar * buf = ra->buf;
+
+    join_pthread(control, ra->thread, NULL);
+    print_maxverbose("Read ahead %'" PRId64 " bytes of stdin\n", ra->len);
+    st->mmap_size = ra->size;
+    ra->buf = NULL;
+    return buf;
+}
+
+/* stdin is not file backed so we have to emulate the mmap by mapping
+ * anonymous ram and reading stdin into it. It means the maximum ram
+ * we can use will be less but we will already have determined this in
+ * rzip_chunk. The first done bytes may already be there from the read
+ * ahead, eof if it already met the end of stdin. */
+static inline void mmap_stdin(rzip_control * control, uchar * buf, struct rzip_state * st, i64 done, bool eof) {
+    i64 total = done;
+
+    if (!eof) total += read_stdin(control, buf + done, st->chunk_size - done, &eof);
+    if (eof) {
+        print_maxverbose("Shrinking chunk to %'" PRId64 "\n", total);
+        if (likely(total)) {
+            buf = (uchar *)mremap(buf, st->chunk_size, total, 0);
+            st->mmap_size = st->chunk_size = total;
+        } else {
+            /* Empty file */
+            buf = (uchar *)mremap(buf, st->chunk_size, control->page_size, 0);
+            st->mmap_size = control->page_size;
+            st->chunk_size = 0;
+        }
+        if (unlikely(buf == MAP_FAILED)) fatal("Failed to remap to smaller buf in mmap_stdin\n");
+        control->eof = st->stdin_eof = 1;
+    }
     control->st_size += total;
 }
 
 static inline void init_sliding_mmap(rzip_control * control, struct rzip_state * st, int fd_in, i64 offset) {
     struct sliding_buffer * sb = &control->sb;
 
-    /* Initialise the high buffer. One page size is fastest to manipulate */
-    if (!STDIN) {
-        sb->high_length = control->page_size;
-        sb->buf_high = (uchar *)mmap(NULL, sb->high_length, PROT_READ, MAP_SHARED, fd_in, offset);
-        if (unlikely(sb->buf_high == MAP_FAILED)) fatal("Unable to mmap buf_high in init_sliding_mmap\n");
-        sb->size_high = sb->high_length;
-        sb->offset_high = 0;
-    }
+    init_high_sb(control, sb);
     sb->offset_low = 0;
     sb->offset_search = 0;
     sb->size_low = st->mmap_size;
@@ -758,31 +1459,92 @@ static void add_to_sslist(rzip_control * control, struct rzip_state * st) {
     st->head = node;
 }
 
+/* Fault in the low buffer ahead of the search, so the search itself rarely
+ * waits on a page fault.  The pages stay mapped behind it: any earlier
+ * offset of the chunk may still be a match source, and the sliding mmap
+ * unmaps what falls out of its low window anyway. */
+static void * prefetch_thread(void * data) {
+    rzip_control * control = data;
+    struct sliding_buffer * sb = &control->sb;
+    volatile uchar sink __maybe_unused;
+
+    while (!__atomic_load_n(&sb->prefetch_stop, __ATOMIC_RELAXED)) {
+        i64 search = __atomic_load_n(&sb->offset_search, __ATOMIC_RELAXED), from, to, i;
+
+        lock_mutex(control, &sb->prefetch_lock);
+        from = MAX(sb->offset_prefetch, MAX(search, sb->offset_low));
+        /* The low buffer is mapped in whole pages, don't touch any past the chunk */
+        to = MIN(MIN(search + PREFETCH_AHEAD, sb->offset_low + sb->size_low), from + PREFETCH_BATCH);
+        to = MIN(to, sb->orig_size);
+        for (i = from; i < to; i += control->page_size) sink = sb->buf_low[i - sb->offset_low];
+        if (to > from) sb->offset_prefetch = to;
+        unlock_mutex(control, &sb->prefetch_lock);
+
+        if (to <= from) {
+            if (from >= sb->orig_size) break;
+            usleep(1000);
+        }
+    }
+    return NULL;
+}
+
+static void start_prefetch(rzip_control * control, pthread_t * thread) {
+    struct sliding_buffer * sb = &control->sb;
+
+    sb->offset_prefetch = 0;
+    sb->prefetch_stop = false;
+    init_mutex(control, &sb->prefetch_lock);
+    sb->prefetch = true;
+    create_pthread(control, thread, NULL, prefetch_thread, control);
+}
+
+static void stop_prefetch(rzip_control * control, pthread_t thread) {
+    struct sliding_buffer * sb = &control->sb;
+
+    __atomic_store_n(&sb->prefetch_stop, true, __ATOMIC_RELAXED);
+    join_pthread(control, thread, NULL);
+    sb->prefetch = false;
+    pthread_mutex_destroy(&sb->prefetch_lock);
+}
+
 /* compress a chunk of an open file. Assumes that the file is able to
    be mmap'd and is seekable */
-static inline void rzip_chunk(rzip_control * control, struct rzip_state * st, int fd_in, int fd_out, i64 offset,
-                              double pct_base, double pct_multiple) {
+static inline void rzip_chunk(rzip_control * control, struct rzip_state * st, int fd_in, int fd_out, i64 offset) {
     struct sliding_buffer * sb = &control->sb;
+    pthread_t prefetch;
+    bool prefetching;
+    int nsegs;
 
     init_sliding_mmap(control, st, fd_in, offset);
 
-    st->ss = open_stream_out(control, fd_out, NUM_STREAMS, st->chunk_size, st->chunk_bytes);
+    st->ss = open_stream_out(control, fd_out, SPLIT_STREAMS ? NUM_SPLIT_STREAMS : NUM_STREAMS, st->chunk_size,
+                             st->chunk_bytes);
     if (unlikely(!st->ss)) fatal("Failed to open streams in rzip_chunk\n");
 
     print_verbose("Beginning rzip pre-processing phase\n");
-    hash_search(control, st, pct_base, pct_multiple);
+    if (st->mmap_size < st->chunk_size || !(nsegs = prepare_segments(control, st))) {
+        /* STDIN data is read into memory already, nothing to fault in */
+        prefetching = !STDIN && st->chunk_size;
+        if (prefetching) start_prefetch(control, &prefetch);
+        if (st->mmap_size < st->chunk_size)
+            sliding_hash_search(control, st);
+        else
+            single_hash_search(control, st);
+        if (prefetching) stop_prefetch(control, prefetch);
+    } else {
+        print_verbose("Searching %'d segments in parallel\n", nsegs);
+        parallel_hash_search(control, st, nsegs);
+    }
+
+    /* Have the start of the next chunk read in while this one is flushed */
+    if (!STDIN && !control->eof) posix_fadvise(fd_in, offset + st->chunk_size, PREFETCH_AHEAD, POSIX_FADV_WILLNEED);
 
     /* unmap buffer before closing and reallocating streams */
     if (unlikely(munmap(sb->buf_low, sb->size_low))) {
         close_stream_out(control, st->ss);
         fatal("Failed to munmap in rzip_chunk\n");
     }
-    if (!STDIN) {
-        if (unlikely(munmap(sb->buf_high, sb->size_high))) {
-            close_stream_out(control, st->ss);
-            fatal("Failed to munmap in rzip_chunk\n");
-        }
-    }
+    if (!STDIN) clear_high_sb(control, sb);
 
     if (unlikely(close_stream_out(control, st->ss))) fatal("Failed to flush/close streams in rzip_chunk\n");
 
@@ -826,15 +1588,18 @@ void rzip_fd(rzip_control * control, int fd_in, int fd_out) {
     /* init CRC */
     gcry_md_open(&control->crc_handle, *control->crc_gcode, GCRY_MD_FLAG_SECURE);
     if (unlikely(control->crc_handle == NULL)) fatal("Cannot create CRC Handle in rzip_fd\n");
-    if (HAS_HASH) {
-        gcry_md_open(&control->hash_handle, *control->hash_gcode, GCRY_MD_FLAG_SECURE);
-        if (unlikely(control->hash_handle == NULL)) fatal("Cannot create %s Handle in rzip_fd\n", *control->hash_label);
-    }
-    cksem_init(control, &control->cksumsem);
-    cksem_post(control, &control->cksumsem);
+    if (HAS_HASH) file_hash_open(control, &control->hash_handle);
+    start_cksum(control);
 
     st = calloc(sizeof(*st), 1);
     if (unlikely(!st)) fatal("Failed to allocate control state in rzip_fd\n");
+    st->tokens[0] = malloc(TOKENS_SIZE * 3);
+    if (unlikely(!st->tokens[0])) {
+        dealloc(st);
+        fatal("Failed to allocate token buffers in rzip_fd\n");
+    }
+    st->tokens[1] = st->tokens[0] + TOKENS_SIZE;
+    st->tokens[2] = st->tokens[1] + TOKENS_SIZE;
 
     if (unlikely(fstat(fd_in, &s))) {
         dealloc(st);
@@ -884,6 +1649,8 @@ void rzip_fd(rzip_control * control, int fd_in, int fd_out) {
         control->max_chunk = control->window * CHUNK_MULTIPLE;
     else
         control->max_chunk = control->ramsize / 3 * 2;
+    /* Hash entries only have room for offsets below MAX_HASH_OFFSET. */
+    control->max_chunk = MIN(control->max_chunk, MAX_HASH_OFFSET);
     control->max_mmap = MIN(control->max_mmap, control->max_chunk);
     if (control->max_chunk < control->st_size) round_to_page(&control->max_chunk);
 
@@ -898,6 +1665,23 @@ void rzip_fd(rzip_control * control, int fd_in, int fd_out) {
     st->fd_out = fd_out;
     st->stdin_eof = 0;
 
+    /* Match into earlier chunks when there will be any, and the input can be
+     * read back to verify the matches. */
+    if (!STDIN && st->chunk_size < len) {
+        i64 farsize = st->level->mb_used * (ONE_MB / sizeof(st->far_index[0]));
+
+        for (st->far_bits = 0; (1LL << st->far_bits) < farsize; st->far_bits++)
+            ;
+        st->far_index = calloc(sizeof(st->far_index[0]), 1LL << st->far_bits);
+        st->far_buf = malloc(2 * FAR_BLOCK);
+        if (unlikely(!st->far_index || !st->far_buf)) {
+            dealloc(st);
+            fatal("Failed to allocate far match index in rzip_fd\n");
+        }
+        control->flags |= FLAG_FAR_MATCH;
+        print_maxverbose("Far match index of %'" PRId64 " anchors\n", (i64)1 << st->far_bits);
+    }
+
     init_hash_indexes(st);
 
     passes = 0;
@@ -907,13 +1691,11 @@ void rzip_fd(rzip_control * control, int fd_in, int fd_out) {
     gettimeofday(&start, NULL);
 
     prepare_streamout_threads(control);
-    control->do_mcpy = single_mcpy;
-    control->next_tag = &single_next_tag;
-    control->full_tag = &single_full_tag;
-    control->match_len = &single_match_len;
+    progress_start(control, STDIN ? 0 : control->st_size, false);
+    ratectl_start(control);
 
     while (!pass || len > 0 || (STDIN && !st->stdin_eof)) {
-        double pct_base, pct_multiple;
+        double pct_base;
         i64 offset = s.st_size - len;
         int bits = 8;
 
@@ -929,28 +1711,38 @@ void rzip_fd(rzip_control * control, int fd_in, int fd_out) {
 
     retry:
         if (STDIN) {
-            /* NOTE the buf is saved here for STDIN mode */
-            sb->buf_low = mmap(NULL, st->mmap_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-            /* Better to shrink the window to the largest size that works than fail */
-            if (sb->buf_low == MAP_FAILED) {
-                if (unlikely(errno != ENOMEM)) {
-                    close_streamout_threads(control);
-                    dealloc(st->hash_table);
-                    dealloc(st);
-                    fatal("Failed to mmap %s\n", control->infile);
-                }
-                st->mmap_size = st->mmap_size / 10 * 9;
-                round_to_page(&st->mmap_size);
-                if (unlikely(!st->mmap_size)) {
-                    close_streamout_threads(control);
-                    dealloc(st->hash_table);
-                    dealloc(st);
-                    fatal("Unable to mmap any ram\n");
+            i64 done = 0;
+            bool eof = false;
+
+            if (st->ahead.buf) {
+                sb->buf_low = take_read_ahead(control, st);
+                done = st->ahead.len;
+                eof = st->ahead.eof;
+            } else {
+                /* NOTE the buf is saved here for STDIN mode */
+                sb->buf_low = mmap(NULL, st->mmap_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+                /* Better to shrink the window to the largest size that works than fail */
+                if (sb->buf_low == MAP_FAILED) {
+                    if (unlikely(errno != ENOMEM)) {
+                        close_streamout_threads(control);
+                        dealloc(st->hash_table);
+                        dealloc(st);
+                        fatal("Failed to mmap %s\n", control->infile);
+                    }
+                    st->mmap_size = st->mmap_size / 10 * 9;
+                    round_to_page(&st->mmap_size);
+                    if (unlikely(!st->mmap_size)) {
+                        close_streamout_threads(control);
+                        dealloc(st->hash_table);
+                        dealloc(st);
+                        fatal("Unable to mmap any ram\n");
+                    }
+                    goto retry;
                 }
-                goto retry;
+                advise_input(sb->buf_low, st->mmap_size, 0);
             }
             st->chunk_size = st->mmap_size;
-            mmap_stdin(control, sb->buf_low, st);
+            mmap_stdin(control, sb->buf_low, st, done, eof);
         } else {
             /* NOTE The buf is saved here for !STDIN mode */
             sb->buf_low = (uchar *)mmap(sb->buf_low, st->mmap_size, PROT_READ, MAP_SHARED, fd_in, offset);
@@ -971,15 +1763,11 @@ void rzip_fd(rzip_control * control, int fd_in, int fd_out) {
                 }
                 goto retry;
             }
-            if (st->mmap_size < st->chunk_size) {
+            advise_input(sb->buf_low, st->mmap_size, PREFETCH_AHEAD);
+            if (st->mmap_size < st->chunk_size)
                 print_maxverbose("Enabling sliding mmap mode and using mmap of %'" PRId64
                                  " bytes with window of %'" PRId64 " bytes\n",
                                  st->mmap_size, st->chunk_size);
-                control->do_mcpy = &sliding_mcpy;
-                control->next_tag = &sliding_next_tag;
-                control->full_tag = &sliding_full_tag;
-                control->match_len = &sliding_match_len;
-            }
         }
         print_maxverbose("Succeeded in testing %'" PRId64 " sized mmap for rzip pre-processing\n", st->mmap_size);
 
@@ -1012,7 +1800,6 @@ void rzip_fd(rzip_control * control, int fd_in, int fd_out) {
             pct_base = (100.0 * -len) / control->st_size;
         else
             pct_base = (100.0 * (control->st_size - len)) / control->st_size;
-        pct_multiple = ((double)st->chunk_size) / control->st_size;
         pass++;
         if (st->stdin_eof) passes = pass;
 
@@ -1047,7 +1834,9 @@ void rzip_fd(rzip_control * control, int fd_in, int fd_out) {
         last.tv_usec = current.tv_usec;
 
         if (st->chunk_size == len) control->eof = 1;
-        rzip_chunk(control, st, fd_in, fd_out, offset, pct_base, pct_multiple);
+        if (STDIN && !st->stdin_eof) start_read_ahead(control, st);
+        progress_chunk(control, offset, st->chunk_size, STDIN && !st->stdin_eof ? 0 : control->st_size);
+        rzip_chunk(control, st, fd_in, fd_out, offset);
 
         /* st->chunk_size may be shrunk in rzip_chunk */
         last_chunk = st->chunk_size;
@@ -1060,19 +1849,22 @@ void rzip_fd(rzip_control * control, int fd_in, int fd_out) {
         }
     }
 
+    progress_set(control, last_chunk);
+    progress_stop(control);
     if (likely(st->hash_table)) dealloc(st->hash_table);
+    dealloc(st->far_index);
+    dealloc(st->far_buf);
+    dealloc(st->tokens[0]);
+    dealloc(control->sb.high);
+    stop_cksum(control);
+    clear_segments(control, st);
     if (unlikely(!close_streamout_threads(control))) {
         dealloc(st);
         fatal("Failed to close_streamout_threads in rzip_fd\n");
     }
 
     if (HAS_HASH) {
-        /* if we're using an XOF function, i.e. SLACK128, then use md_extract */
-        if (control->hash_code < SHAKE128_16)
-            memcpy(control->hash_resblock, gcry_md_read(control->hash_handle, *control->hash_gcode),
-                   *control->hash_len);
-        else
-            gcry_md_extract(control->hash_handle, *control->hash_gcode, control->hash_resblock, *control->hash_len);
+        file_hash_read(control, &control->hash_handle, control->hash_resblock);
         if (HASH_CHECK || MAX_VERBOSE) {
             print_progress("%s: ", control->hash_label);
             for (j = 0; j < *control->hash_len; j++) print_progress("%02x", control->hash_resblock[j]);
@@ -1107,6 +1899,8 @@ void rzip_fd(rzip_control * control, int fd_in, int fd_out) {
 
     print_maxverbose("matches=%'u match_bytes=%'u\n", (unsigned int)st->stats.matches,
                      (unsigned int)st->stats.match_bytes);
+    print_maxverbose("far_matches=%'u far_match_bytes=%'" PRId64 "\n", (unsigned int)st->stats.far_matches,
+                     st->stats.far_match_bytes);
     print_maxverbose("literals=%'u literal_bytes=%'u\n", (unsigned int)st->stats.literals,
                      (unsigned int)st->stats.literal_bytes);
     print_maxverbose("true_tag_positives=%'u false_tag_positives=%'u\n", (unsigned int)st->stats.tag_hits,
@@ -1126,7 +1920,7 @@ void rzip_fd(rzip_control * control, int fd_in, int fd_out) {
         print_progress("Cannot compute compression ratio with STDOUT\n");
 
     clear_sslist(st);
-    gcry_md_close(control->hash_handle);
+    if (HAS_HASH) file_hash_close(control, &control->hash_handle);
     gcry_md_close(control->crc_handle);
     dealloc(st);
 }
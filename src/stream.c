@@ -28,11 +28,16 @@
 #include <sys/resource.h>
 #include <sys/statvfs.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "../include/bufpool.h"
 #include "../include/config.h"
 #include "../include/mrzip_core.h"
+#include "../include/outq.h"
+#include "../include/ratectl.h"
+#include "../include/writeback.h"
 #include "../include/util.h"
 #include "../vendor/bzip3/include/libbz3.h"
 #include "../vendor/fast-lzma2/fast-lzma2.h"
@@ -49,21 +54,23 @@ static struct compress_thread {
     uchar c_type;  /* Compression type */
     i64 s_len;     /* Data length uncompressed */
     i64 c_len;     /* Data length compressed */
-    cksem_t cksem; /* This thread's semaphore */
+    int level;     /* Backend level, rate control may lower it */
     struct stream_info * sinfo;
     int streamno;
     uchar salt[SALT_LEN];
+    bool busy;  /* Has a buffer that is not written out yet */
+    bool ready; /* Compressed, waiting for its turn to be written */
+    struct pool_task task;
 } * cthreads;
 
-typedef struct stream_thread_struct {
-    int i; /* this is the current thread */
-    rzip_control * control;
-    struct stream_info * sinfo;
-} stream_thread_struct;
-
 static int output_thread;
 static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t output_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t write_cond = PTHREAD_COND_INITIALIZER; /* A block is ready for the writer */
+static pthread_t writer;
+static bool writer_stop;
+static int cpu_threads;     /* Threads asked for, before the one added for rzip */
+static bool stream_closing; /* The last blocks of a stream are being compressed */
 
 static unsigned save_threads = 0;  // need for multiple chunks to restore thread count
 static i64 limit = 0;              // save for open_stream_out
@@ -84,12 +91,31 @@ bool lock_mutex(rzip_control * control, pthread_mutex_t * mutex) {
     return true;
 }
 
-static bool cond_wait(rzip_control * control, pthread_cond_t * cond, pthread_mutex_t * mutex) {
+bool init_cond(rzip_control * control, pthread_cond_t * cond) {
+    if (unlikely(pthread_cond_init(cond, NULL))) fatal("Failed to pthread_cond_init\n");
+    return true;
+}
+
+bool cond_wait(rzip_control * control, pthread_cond_t * cond, pthread_mutex_t * mutex) {
     if (unlikely(pthread_cond_wait(cond, mutex))) fatal("Failed to pthread_cond_wait\n");
     return true;
 }
 
-static bool cond_broadcast(rzip_control * control, pthread_cond_t * cond) {
+/* As cond_wait, but gives up after usecs microseconds */
+bool cond_timedwait(rzip_control * control, pthread_cond_t * cond, pthread_mutex_t * mutex, i64 usecs) {
+    struct timespec ts;
+    int ret;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    usecs += ts.tv_nsec / 1000;
+    ts.tv_sec += usecs / 1000000;
+    ts.tv_nsec = usecs % 1000000 * 1000;
+    ret = pthread_cond_timedwait(cond, mutex, &ts);
+    if (unlikely(ret && ret != ETIMEDOUT)) fatal("Failed to pthread_cond_timedwait\n");
+    return true;
+}
+
+bool cond_broadcast(rzip_control * control, pthread_cond_t * cond) {
     if (unlikely(pthread_cond_broadcast(cond))) fatal("Failed to pthread_cond_broadcast\n");
     return true;
 }
@@ -110,23 +136,205 @@ bool join_pthread(rzip_control * control, pthread_t th, void ** thread_return) {
     return true;
 }
 
+/* The backends run on a pool of threads created once for the whole process
+ * and fed in submission order. Threads may wait for their turn when they
+ * retry serialised, so the pool grows to as many threads as there are thread
+ * slots in use: the task whose turn it is must never be queued behind them. */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+    struct pool_task *head, *tail;
+    int workers;
+    int codec_gen; /* Bumped when the workers are to free their contexts */
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0 };
+
+/* Backend contexts are costly to set up, the lzma and bzip3 ones carry their
+ * whole match finder or BWT state. Each worker creates them the first time it
+ * needs them and keeps them for every task it runs after, until the stream is
+ * closed and the worker runs out of work: the memory is not budgeted for
+ * beyond the stream, and the next chunk's rzip phase wants it. */
+struct codec_ctx {
+    ZSTD_CCtx * zstd_c;
+    ZSTD_DCtx * zstd_d;
+    FL2_CCtx * lzma_c;
+    FL2_DCtx * lzma_d;
+    struct bz3_state * bz3;
+    u32 bz3_block_size;
+};
+
+/* Free the compression context of c_type */
+static void free_codec(struct codec_ctx * codec, uchar c_type) {
+    if (c_type == CTYPE_ZSTD && codec->zstd_c) {
+        ZSTD_freeCCtx(codec->zstd_c);
+        codec->zstd_c = NULL;
+    } else if (c_type == CTYPE_LZMA && codec->lzma_c) {
+        FL2_freeCCtx(codec->lzma_c);
+        codec->lzma_c = NULL;
+    } else if (c_type == CTYPE_BZIP3 && codec->bz3) {
+        bz3_free(codec->bz3);
+        codec->bz3 = NULL;
+    }
+}
+
+static void free_codecs(struct codec_ctx * codec) {
+    free_codec(codec, CTYPE_ZSTD);
+    free_codec(codec, CTYPE_LZMA);
+    free_codec(codec, CTYPE_BZIP3);
+    if (codec->zstd_d) ZSTD_freeDCtx(codec->zstd_d);
+    if (codec->lzma_d) FL2_freeDCtx(codec->lzma_d);
+    memset(codec, 0, sizeof(*codec));
+}
+
+static void * pool_worker(void * data) {
+    rzip_control * control = data;
+    struct codec_ctx codec = { NULL };
+    int gen = 0;
+
+    while (42) {
+        struct pool_task * task;
+        void * ret;
+
+        lock_mutex(control, &pool.lock);
+        while (!pool.head && gen == pool.codec_gen) cond_wait(control, &pool.queued, &pool.lock);
+        if (!pool.head) {
+            gen = pool.codec_gen;
+            unlock_mutex(control, &pool.lock);
+            free_codecs(&codec);
+            continue;
+        }
+        task = pool.head;
+        pool.head = task->next;
+        if (!pool.head) pool.tail = NULL;
+        unlock_mutex(control, &pool.lock);
+
+        task->codec = &codec;
+        ret = task->func(task);
+
+        lock_mutex(control, &pool.lock);
+        task->ret = ret;
+        task->done = true;
+        cond_broadcast(control, &pool.done);
+        unlock_mutex(control, &pool.lock);
+    }
+    return NULL;
+}
+
+/* Make sure there are at least n threads in the pool */
+static void pool_reserve(rzip_control * control, int n) {
+    lock_mutex(control, &pool.lock);
+    for (; pool.workers < n; pool.workers++) {
+        pthread_t thread;
+
+        create_pthread(control, &thread, NULL, pool_worker, control);
+        detach_pthread(control, &thread);
+    }
+    unlock_mutex(control, &pool.lock);
+}
+
+/* The workers compressing blocks side by side, without the one added to
+ * keep the CPUs busy while rzip runs */
+int pool_compress_workers(rzip_control * control) {
+    int n;
+
+    lock_mutex(control, &pool.lock);
+    n = MIN(pool.workers, cpu_threads);
+    unlock_mutex(control, &pool.lock);
+    return MAX(n, 1);
+}
+
+static void pool_submit(rzip_control * control, struct pool_task * task, void * (*func)(struct pool_task *),
+                        struct stream_info * sinfo, int no) {
+    lock_mutex(control, &pool.lock);
+    task->func = func;
+    task->control = control;
+    task->sinfo = sinfo;
+    task->no = no;
+    task->ret = NULL;
+    task->done = false;
+    task->next = NULL;
+    if (pool.tail)
+        pool.tail->next = task;
+    else
+        pool.head = task;
+    pool.tail = task;
+    cond_broadcast(control, &pool.queued);
+    unlock_mutex(control, &pool.lock);
+}
+
+/* Have the workers free their backend contexts once they run out of work */
+static void pool_release_codecs(rzip_control * control) {
+    lock_mutex(control, &pool.lock);
+    pool.codec_gen++;
+    cond_broadcast(control, &pool.queued);
+    unlock_mutex(control, &pool.lock);
+}
+
+/* Wait for a task to finish and return what it returned */
+static void * pool_wait(rzip_control * control, struct pool_task * task) {
+    lock_mutex(control, &pool.lock);
+    while (!task->done) cond_wait(control, &pool.done, &pool.lock);
+    unlock_mutex(control, &pool.lock);
+    return task->ret;
+}
+
+static ZSTD_CCtx * zstd_cctx(rzip_control * control, struct codec_ctx * codec) {
+    if (!codec->zstd_c && unlikely(!(codec->zstd_c = ZSTD_createCCtx()))) fatal("Failed to create zstd context\n");
+    return codec->zstd_c;
+}
+
+/* Blocks may be framed with windows larger than the default limit */
+static ZSTD_DCtx * zstd_dctx(rzip_control * control, struct codec_ctx * codec) {
+    if (!codec->zstd_d) {
+        if (unlikely(!(codec->zstd_d = ZSTD_createDCtx()))) fatal("Failed to create zstd context\n");
+        ZSTD_DCtx_setParameter(codec->zstd_d, ZSTD_d_windowLogMax, ZSTD_WINDOWLOG_MAX);
+    }
+    return codec->zstd_d;
+}
+
+static FL2_CCtx * lzma_cctx(rzip_control * control, struct codec_ctx * codec) {
+    if (!codec->lzma_c && unlikely(!(codec->lzma_c = FL2_createCCtx()))) fatal("Failed to create lzma context\n");
+    return codec->lzma_c;
+}
+
+static FL2_DCtx * lzma_dctx(rzip_control * control, struct codec_ctx * codec) {
+    if (!codec->lzma_d && unlikely(!(codec->lzma_d = FL2_createDCtx()))) fatal("Failed to create lzma context\n");
+    return codec->lzma_d;
+}
+
+/* The state is sized for one block size, archives may use another */
+static struct bz3_state * bzip3_state(rzip_control * control, struct codec_ctx * codec) {
+    if (codec->bz3 && codec->bz3_block_size != control->bzip3_block_size) {
+        bz3_free(codec->bz3);
+        codec->bz3 = NULL;
+    }
+    if (!codec->bz3) {
+        codec->bz3 = bz3_new(control->bzip3_block_size);
+        if (unlikely(!codec->bz3))
+            fatal("Failed to allocate %'" PRIu32 " bytes bzip3 state.\n", control->bzip3_block_size);
+        codec->bz3_block_size = control->bzip3_block_size;
+    }
+    return codec->bz3;
+}
+
 /* just to keep things clean, declare function here
  * but move body to the end since it's a work function
  */
-static int lz4_compresses(rzip_control * control, uchar * s_buf, i64 s_len);
+static int entropy_compresses(rzip_control * control, uchar * s_buf, i64 s_len);
+static void * writer_thread(void * data);
+static void wait_written(rzip_control * control, int i);
 
-static int bzip3_compress_buf(rzip_control * control, struct compress_thread * cthread, int current_thread) {
+static int bzip3_compress_buf(rzip_control * control, struct compress_thread * cthread, struct codec_ctx * codec,
+                              int current_thread) {
     i64 c_len, c_size;
     uchar * c_buf;
 
-    struct bz3_state * state;
-
-    if (LZ4_TEST) {
-        if (!lz4_compresses(control, cthread->s_buf, cthread->s_len)) return 0;
+    if (LZ4_TEST && !AUTO_COMPRESS) {
+        if (!entropy_compresses(control, cthread->s_buf, cthread->s_len)) return 0;
     }
 
     c_size = round_up_page(control, cthread->s_len + cthread->s_len / 50 + 30);
-    c_buf = malloc(c_size);
+    c_buf = buf_alloc(control, c_size);
     if (!c_buf) {
         print_err("Unable to allocate c_buf in bzip3_compress_buf\n");
         return -1;
@@ -137,23 +345,19 @@ static int bzip3_compress_buf(rzip_control * control, struct compress_thread * c
     print_verbose("Starting bzip3: bs=%d - %'" PRIu32 " bytes backend...\n", control->bzip3_bs,
                   control->bzip3_block_size);
 
-    state = bz3_new(control->bzip3_block_size);  // allocate bzip3 state
-    if (!state) fatal("Failed to allocate %'" PRIu32 " bytes bzip3 state.\n", control->bzip3_block_size);
-
-    c_len = bz3_encode_block(state, c_buf, cthread->s_len);
+    c_len = bz3_encode_block(bzip3_state(control, codec), c_buf, cthread->s_len);
 
     if (unlikely(c_len >= cthread->c_len)) {
         print_maxverbose("Incompressible block\n");
         /* Incompressible, leave as CTYPE_NONE */
-        dealloc(c_buf);
+        buf_dealloc(c_buf);
         return 0;
     }
 
     cthread->c_len = c_len;
-    dealloc(cthread->s_buf);
+    buf_dealloc(cthread->s_buf);
     cthread->s_buf = c_buf;
     cthread->c_type = CTYPE_BZIP3;
-    bz3_free(state);  // free bzip3 state
     return 0;
 }
 
@@ -165,13 +369,13 @@ static int zpaq_compress_buf(rzip_control * control, struct compress_thread * ct
 
     /* if we're testing compressibility */
     if (LZ4_TEST) {
-        if (!(compressibility = lz4_compresses(control, cthread->s_buf, cthread->s_len))) return 0;
+        if (!(compressibility = entropy_compresses(control, cthread->s_buf, cthread->s_len))) return 0;
     } /* else set compressibility to a neutral value */
     else
         compressibility = 50; /* midpoint */
 
     c_size = round_up_page(control, cthread->s_len + 10000);
-    c_buf = malloc(c_size);
+    c_buf = buf_alloc(control, c_size);
     if (!c_buf) {
         print_err("Unable to allocate c_buf in zpaq_compress_buf\n");
         return -1;
@@ -182,7 +386,7 @@ static int zpaq_compress_buf(rzip_control * control, struct compress_thread * ct
      * 1 and 2 faile however, so only levels 3-5 are used
      * Data types are determined by zpaq_redundancy
      * Type 0 = binary/random. Type 1 = text. Type 2 and 3 not used due to e8e9 */
-    zpaq_redundancy = 256 - (compressibility * 2.55); /* 0, hard, 255, easy. Inverse of lz4_compresses */
+    zpaq_redundancy = 256 - (compressibility * 2.55); /* 0, hard, 255, easy. Inverse of entropy_compresses */
     if (zpaq_redundancy < 25) zpaq_redundancy = 25;   /* too low a value fails */
     if (zpaq_redundancy > 192) zpaq_type = 1;         /* text data */
 
@@ -200,29 +404,60 @@ static int zpaq_compress_buf(rzip_control * control, struct compress_thread * ct
     if (unlikely(c_len >= cthread->c_len)) {
         print_maxverbose("Incompressible block\n");
         /* Incompressible, leave as CTYPE_NONE */
-        dealloc(c_buf);
+        buf_dealloc(c_buf);
         return 0;
     }
 
     cthread->c_len = c_len;
-    dealloc(cthread->s_buf);
+    buf_dealloc(cthread->s_buf);
     cthread->s_buf = c_buf;
     cthread->c_type = CTYPE_ZPAQ;
     return 0;
 }
 
-static int zstd_compress_buf(rzip_control * control, struct compress_thread * cthread) {
+/* Blocks still being compressed, the one asking included */
+static int blocks_compressing(rzip_control * control) {
+    int i, n = 0;
+
+    lock_mutex(control, &output_lock);
+    for (i = 0; i < control->threads; i++) n += cthreads[i].busy && !cthreads[i].ready;
+    unlock_mutex(control, &output_lock);
+    return MAX(n, 1);
+}
+
+static int zstd_compress_buf(rzip_control * control, struct compress_thread * cthread, struct codec_ctx * codec) {
     unsigned long dlen = round_up_page(control, ZSTD_COMPRESSBOUND(cthread->s_len));
+    ZSTD_CCtx * cctx = zstd_cctx(control, codec);
+    int window_log, workers;
     uchar * c_buf;
     size_t zstd_ret;
 
-    c_buf = malloc(dlen);
+    c_buf = buf_alloc(control, dlen);
     if (!c_buf) {
         print_err("Unable to allocate c_buf in zstd_compress_buf\n");
         return -1;
     }
 
-    zstd_ret = ZSTD_compress(c_buf, dlen, cthread->s_buf, cthread->s_len, control->compression_level);
+    /* The window covers the whole block so long distance matching can reach
+     * back to its start. Once a stream is closing, no more blocks will come
+     * to keep the threads busy, so the last ones take the threads not used by
+     * the blocks still in flight as zstd workers, no more than one per MB to
+     * keep the jobs worth the threads. Without ZSTD_MULTITHREAD
+     * setting workers fails and the block is compressed in this thread. */
+    for (window_log = ZSTD_WINDOWLOG_MIN; window_log < ZSTD_WINDOWLOG_MAX && (1LL << window_log) < cthread->s_len;
+         window_log++)
+        ;
+    workers = 0;
+    if (__atomic_load_n(&stream_closing, __ATOMIC_RELAXED))
+        workers = MIN(MIN(cpu_threads, control->threads) - blocks_compressing(control) + 1, cthread->s_len / ONE_MB);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, cthread->level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, window_log);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, workers > 1 ? workers : 0);
+    print_maxverbose("zstd block of %'" PRId64 " bytes, window log %d, %d workers\n", cthread->s_len, window_log,
+                     workers > 1 ? workers : 0);
+
+    zstd_ret = ZSTD_compress2(cctx, c_buf, dlen, cthread->s_buf, cthread->s_len);
     dlen = zstd_ret;
 
     /* if compressed data is bigger then original data leave as
@@ -231,45 +466,47 @@ static int zstd_compress_buf(rzip_control * control, struct compress_thread * ct
     if (ZSTD_isError(zstd_ret) || unlikely((i64)dlen >= cthread->c_len)) {
         print_maxverbose("Incompressible block\n");
         /* Incompressible, leave as CTYPE_NONE */
-        dealloc(c_buf);
+        buf_dealloc(c_buf);
         return 0;
     }
 
     cthread->c_len = dlen;
-    dealloc(cthread->s_buf);
+    buf_dealloc(cthread->s_buf);
     cthread->s_buf = c_buf;
     cthread->c_type = CTYPE_ZSTD;
     return 0;
 }
 
-static int lzma_compress_buf(rzip_control * control, struct compress_thread * cthread, int current_thread) {
+static int lzma_compress_buf(rzip_control * control, struct compress_thread * cthread, struct codec_ctx * codec,
+                             int current_thread) {
     uchar * c_buf;
     size_t dlen;
 
-    if (LZ4_TEST) {
-        if (!lz4_compresses(control, cthread->s_buf, cthread->s_len)) return 0;
+    if (LZ4_TEST && !AUTO_COMPRESS) {
+        if (!entropy_compresses(control, cthread->s_buf, cthread->s_len)) return 0;
     }
 
     print_maxverbose("Starting lzma back end compression thread %'d...\n", current_thread);
     dlen = round_up_page(control, cthread->s_len * 1.05);  // add 5% for lzma overhead to prevent memory overrun
-    c_buf = malloc(dlen);
+    c_buf = buf_alloc(control, dlen);
     if (!c_buf) {
         print_err("Unable to allocate c_buf in lzma_compress_buf\n");
         return -1;
     }
 
-    size_t lzma_ret = FL2_compress(c_buf, dlen, cthread->s_buf, cthread->s_len, control->compression_level);
+    size_t lzma_ret =
+        FL2_compressCCtx(lzma_cctx(control, codec), c_buf, dlen, cthread->s_buf, cthread->s_len, cthread->level);
     dlen = lzma_ret;
 
     if (unlikely((i64)dlen >= cthread->c_len) || FL2_isError(lzma_ret)) {
         /* Incompressible, leave as CTYPE_NONE */
         print_maxverbose("Incompressible block\n");
-        dealloc(c_buf);
+        buf_dealloc(c_buf);
         return 0;
     }
 
     cthread->c_len = dlen;
-    dealloc(cthread->s_buf);
+    buf_dealloc(cthread->s_buf);
     cthread->s_buf = c_buf;
     cthread->c_type = CTYPE_LZMA;
     return 0;
@@ -281,45 +518,148 @@ static int lz4_compress_buf(rzip_control * control, struct compress_thread * cth
     uchar * c_buf;
     int ret = -1;
 
-    c_buf = malloc(dlen);
+    c_buf = buf_alloc(control, dlen);
     if (!c_buf) {
         print_err("Unable to allocate c_buf in lz4_compress_buf");
         return 0;
     }
 
-    if (control->compression_level <= 2) {
+    if (cthread->level <= 2) {
         if ((dlen = LZ4_compress_default((const char *)cthread->s_buf, (char *)c_buf, in_len, dlen)) == 0) {
             /* Incompressible, leave as CTYPE_NONE */
             print_maxverbose("Incompressible block\n");
-            dealloc(c_buf);
+            buf_dealloc(c_buf);
             return 0;
         }
     } else {
-        if ((dlen = LZ4_compress_HC((const char *)cthread->s_buf, (char *)c_buf, in_len, dlen,
-                                    control->compression_level)) == 0) {
+        if ((dlen = LZ4_compress_HC((const char *)cthread->s_buf, (char *)c_buf, in_len, dlen, cthread->level)) ==
+            0) {
             /* Incompressible, leave as CTYPE_NONE */
             print_maxverbose("Incompressible block\n");
-            dealloc(c_buf);
+            buf_dealloc(c_buf);
             return 0;
         }
     }
 
     cthread->c_len = dlen;
-    dealloc(cthread->s_buf);
+    buf_dealloc(cthread->s_buf);
     cthread->s_buf = c_buf;
     cthread->c_type = CTYPE_LZ4;
     return 0;
 }
 
-static int bzip3_decompress_buf(rzip_control * control, struct uncomp_thread * ucthread, int current_thread) {
+/* Auto mode compresses AUTO_SAMPLE bytes from the middle of each block with
+ * every candidate and keeps the cheapest. A candidate costs its output size
+ * plus the cpu time it took, at AUTO_TIME_COST bytes a second, so lower
+ * levels trade more size for speed. Storing costs the sample size. */
+#define AUTO_SAMPLE (256 * 1024)
+#define AUTO_TIME_COST(level) ((double)(ONE_MB * 4) / (1 << (level)))
+
+static const uchar auto_candidates[] = { CTYPE_LZ4, CTYPE_ZSTD, CTYPE_BZIP3, CTYPE_LZMA };
+
+/* Compress a block with the given backend, CTYPE_NONE leaves it stored */
+static int compress_with(rzip_control * control, struct compress_thread * cthread, struct codec_ctx * codec,
+                         uchar c_type, int current_thread) {
+    switch (c_type) {
+        case CTYPE_LZ4:
+            return lz4_compress_buf(control, cthread);
+        case CTYPE_ZSTD:
+            return zstd_compress_buf(control, cthread, codec);
+        case CTYPE_BZIP3:
+            return bzip3_compress_buf(control, cthread, codec, current_thread);
+        case CTYPE_LZMA:
+            return lzma_compress_buf(control, cthread, codec, current_thread);
+    }
+    return 0;
+}
+
+static double wall_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double thread_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Size of len bytes at src compressed with c_type into dst, 0 on failure */
+static i64 trial_compress(rzip_control * control, struct codec_ctx * codec, uchar c_type, int level, uchar * src,
+                          i64 len, uchar * dst, i64 dlen) {
+    size_t ret;
+
+    switch (c_type) {
+        case CTYPE_LZ4:
+            if (level <= 2) return LZ4_compress_default((const char *)src, (char *)dst, len, dlen);
+            return LZ4_compress_HC((const char *)src, (char *)dst, len, dlen, level);
+        case CTYPE_ZSTD:
+            ret = ZSTD_compressCCtx(zstd_cctx(control, codec), dst, dlen, src, len, level);
+            return ZSTD_isError(ret) ? 0 : ret;
+        case CTYPE_LZMA:
+            ret = FL2_compressCCtx(lzma_cctx(control, codec), dst, dlen, src, len, level);
+            return FL2_isError(ret) ? 0 : ret;
+        case CTYPE_BZIP3:
+            memcpy(dst, src, len);
+            return MAX(bz3_encode_block(bzip3_state(control, codec), dst, len), 0);
+    }
+    return 0;
+}
+
+static int auto_compress_buf(rzip_control * control, struct compress_thread * cthread, struct codec_ctx * codec,
+                             int current_thread) {
+    i64 len = MIN(cthread->s_len, AUTO_SAMPLE), dlen, c_len;
+    uchar * sample = cthread->s_buf + (cthread->s_len - len) / 2;
+    uchar * c_buf, best = CTYPE_NONE;
+    double best_cost = len;
+    unsigned i;
+
+    if (LZ4_TEST && !entropy_compresses(control, cthread->s_buf, cthread->s_len)) return 0;
+
+    dlen = round_up_page(control, ZSTD_COMPRESSBOUND(len) + len / 16 + 64);
+    c_buf = buf_alloc(control, dlen);
+    if (!c_buf) {
+        print_err("Unable to allocate c_buf in auto_compress_buf\n");
+        return -1;
+    }
+    for (i = 0; i < sizeof(auto_candidates); i++) {
+        uchar c_type = auto_candidates[i];
+        double start, cost;
+
+        /* bzip3 codes a block in one go */
+        if (c_type == CTYPE_BZIP3 && cthread->s_len > control->bzip3_block_size) continue;
+        start = thread_seconds();
+        c_len = trial_compress(control, codec, c_type, cthread->level, sample, len, c_buf, dlen);
+        if (c_len <= 0 || c_len >= len) continue;
+        cost = c_len + (thread_seconds() - start) * AUTO_TIME_COST(cthread->level);
+        print_maxverbose("Auto trial %s: %'" PRId64 " of %'" PRId64 " bytes, cost %.0f\n", ctype_names[c_type], c_len,
+                         len, cost);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = c_type;
+        }
+    }
+    buf_dealloc(c_buf);
+    /* The budget covers one backend's context per thread, not all of them */
+    for (i = 0; i < sizeof(auto_candidates); i++)
+        if (auto_candidates[i] != best) free_codec(codec, auto_candidates[i]);
+    print_maxverbose("Auto mode picked %s for thread %'d block of %'" PRId64 " bytes\n", ctype_names[best],
+                     current_thread, cthread->s_len);
+    return compress_with(control, cthread, codec, best, current_thread);
+}
+
+static int bzip3_decompress_buf(rzip_control * control, struct uncomp_thread * ucthread, struct codec_ctx * codec,
+                                int current_thread) {
     i64 dlen = ucthread->u_len;
+    struct bz3_state * state;
     uchar * c_buf;
     int ret = 0;
 
-    struct bz3_state * state;
-
     c_buf = ucthread->s_buf;
-    ucthread->s_buf = malloc(round_up_page(control, dlen));
+    ucthread->s_buf = buf_alloc(control, round_up_page(control, dlen));
     if (unlikely(!ucthread->s_buf)) {
         print_err("Failed to allocate %'" PRId64 " bytes for decompression\n", dlen);
         ret = -1;
@@ -327,8 +667,7 @@ static int bzip3_decompress_buf(rzip_control * control, struct uncomp_thread * u
     }
     memcpy(ucthread->s_buf, c_buf, ucthread->c_len);
 
-    state = bz3_new(control->bzip3_block_size);
-
+    state = bzip3_state(control, codec);
     dlen = bz3_decode_block(state, ucthread->s_buf, ucthread->c_len, ucthread->u_len);
     if (bz3_last_error(state) != BZ3_OK) fatal("Failed to decompress with bz3 %s\n", bz3_strerror(state));
 
@@ -337,13 +676,12 @@ static int bzip3_decompress_buf(rzip_control * control, struct uncomp_thread * u
                   ucthread->u_len);
         ret = -1;
     } else
-        dealloc(c_buf);
+        buf_dealloc(c_buf);
 out:
     if (ret == -1) {
-        dealloc(ucthread->s_buf);
+        buf_dealloc(ucthread->s_buf);
         ucthread->s_buf = c_buf;
     }
-    bz3_free(state);
     return ret;
 }
 
@@ -353,7 +691,7 @@ static int zpaq_decompress_buf(rzip_control * control, struct uncomp_thread * uc
     int ret = 0;
 
     c_buf = ucthread->s_buf;
-    ucthread->s_buf = malloc(round_up_page(control, dlen));
+    ucthread->s_buf = buf_alloc(control, round_up_page(control, dlen));
     if (unlikely(!ucthread->s_buf)) {
         print_err("Failed to allocate %'" PRId64 " bytes for decompression\n", dlen);
         ret = -1;
@@ -369,29 +707,29 @@ static int zpaq_decompress_buf(rzip_control * control, struct uncomp_thread * uc
                   ucthread->u_len);
         ret = -1;
     } else
-        dealloc(c_buf);
+        buf_dealloc(c_buf);
 out:
     if (ret == -1) {
-        dealloc(ucthread->s_buf);
+        buf_dealloc(ucthread->s_buf);
         ucthread->s_buf = c_buf;
     }
     return ret;
 }
 
-static int zstd_decompress_buf(rzip_control * control, struct uncomp_thread * ucthread) {
+static int zstd_decompress_buf(rzip_control * control, struct uncomp_thread * ucthread, struct codec_ctx * codec) {
     unsigned long dlen = ucthread->u_len;
     int ret = 0;
     uchar * c_buf;
 
     c_buf = ucthread->s_buf;
-    ucthread->s_buf = malloc(round_up_page(control, dlen));
+    ucthread->s_buf = buf_alloc(control, round_up_page(control, dlen));
     if (unlikely(!ucthread->s_buf)) {
         print_err("Failed to allocate %'" PRId64 " bytes for decompression\n", dlen);
         ret = -1;
         goto out;
     }
 
-    size_t gzerr = ZSTD_decompress(ucthread->s_buf, dlen, c_buf, ucthread->c_len);
+    size_t gzerr = ZSTD_decompressDCtx(zstd_dctx(control, codec), ucthread->s_buf, dlen, c_buf, ucthread->c_len);
 
     if (ZSTD_isError(gzerr)) {
         print_err("Failed to decompress buffer - gzerr=%'d\n", gzerr);
@@ -404,30 +742,31 @@ static int zstd_decompress_buf(rzip_control * control, struct uncomp_thread * uc
                   ucthread->u_len);
         ret = -1;
     } else
-        dealloc(c_buf);
+        buf_dealloc(c_buf);
 out:
     if (ret == -1) {
-        dealloc(ucthread->s_buf);
+        buf_dealloc(ucthread->s_buf);
         ucthread->s_buf = c_buf;
     }
     return ret;
 }
 
-static int lzma_decompress_buf(rzip_control * control, struct uncomp_thread * ucthread) {
+static int lzma_decompress_buf(rzip_control * control, struct uncomp_thread * ucthread, struct codec_ctx * codec) {
     size_t dlen = ucthread->u_len;
     int ret = 0, lzmaerr;
     uchar * c_buf;
     size_t c_len = ucthread->c_len;
 
     c_buf = ucthread->s_buf;
-    ucthread->s_buf = malloc(round_up_page(control, dlen));
+    ucthread->s_buf = buf_alloc(control, round_up_page(control, dlen));
     if (unlikely(!ucthread->s_buf)) {
         print_err("Failed to allocate %'" PRId64 " bytes for decompression\n", (i64)dlen);
         ret = -1;
         goto out;
     }
 
-    size_t lzmares = FL2_decompress(ucthread->s_buf, round_up_page(control, dlen), c_buf, c_len);
+    size_t lzmares =
+        FL2_decompressDCtx(lzma_dctx(control, codec), ucthread->s_buf, round_up_page(control, dlen), c_buf, c_len);
 
     if (unlikely(FL2_isError(lzmares))) {
         print_err("Failed to decompress buffer - lzmaerr=%'d\n", lzmares);
@@ -440,10 +779,10 @@ static int lzma_decompress_buf(rzip_control * control, struct uncomp_thread * uc
                   ucthread->u_len);
         ret = -1;
     } else
-        dealloc(c_buf);
+        buf_dealloc(c_buf);
 out:
     if (ret == -1) {
-        dealloc(ucthread->s_buf);
+        buf_dealloc(ucthread->s_buf);
         ucthread->s_buf = c_buf;
     }
     return ret;
@@ -455,7 +794,7 @@ static int lz4_decompress_buf(rzip_control * control, struct uncomp_thread * uct
     uint8_t * c_buf;
 
     c_buf = ucthread->s_buf;
-    ucthread->s_buf = malloc(round_up_page(control, dlen));
+    ucthread->s_buf = buf_alloc(control, round_up_page(control, dlen));
     if (unlikely(!ucthread->s_buf)) {
         print_err("Failed to allocate %'" PRIu32 " bytes for decompression\n", (unsigned long)dlen);
         ret = -1;
@@ -475,10 +814,10 @@ static int lz4_decompress_buf(rzip_control * control, struct uncomp_thread * uct
                   (unsigned long)dlen, ucthread->u_len);
         ret = -1;
     } else
-        dealloc(c_buf);
+        buf_dealloc(c_buf);
 out:
     if (ret == -1) {
-        dealloc(ucthread->s_buf);
+        buf_dealloc(ucthread->s_buf);
         ucthread->s_buf = c_buf;
     }
     return ret;
@@ -726,28 +1065,24 @@ i64 get_readseek(rzip_control * control, int fd) {
 }
 
 bool prepare_streamout_threads(rzip_control * control) {
-    pthread_t * threads;
     int i;
 
     /* As we serialise the generation of threads during the rzip
      * pre-processing stage, it's faster to have one more thread available
      * to keep all CPUs busy. There is no point splitting up the chunks
      * into multiple threads if there will be no compression back end. */
+    cpu_threads = control->threads;
     if (control->threads > 1) ++control->threads;
     if (NO_COMPRESS) control->threads = 1;
-    threads = control->pthreads = calloc(sizeof(pthread_t), control->threads);
-    if (unlikely(!threads)) fatal("Unable to calloc threads in prepare_streamout_threads\n");
-
     cthreads = calloc(sizeof(struct compress_thread), control->threads);
-    if (unlikely(!cthreads)) {
-        dealloc(threads);
-        fatal("Unable to calloc cthreads in prepare_streamout_threads\n");
-    }
-
-    for (i = 0; i < control->threads; i++) {
-        cksem_init(control, &cthreads[i].cksem);
-        cksem_post(control, &cthreads[i].cksem);
-    }
+    if (unlikely(!cthreads)) fatal("Unable to calloc cthreads in prepare_streamout_threads\n");
+    pool_reserve(control, control->threads);
+
+    /* No thread has anything to do yet */
+    for (i = 0; i < control->threads; i++) cthreads[i].task.done = true;
+    if (!TMP_OUTBUF && !STDOUT && !ENCRYPT) outq_start(control, control->fd_out);
+    writer_stop = false;
+    create_pthread(control, &writer, NULL, writer_thread, control);
     return true;
 }
 
@@ -757,12 +1092,18 @@ bool close_streamout_threads(rzip_control * control) {
     /* Wait for the threads in the correct order in case they end up
      * serialised */
     for (i = 0; i < control->threads; i++) {
-        cksem_wait(control, &cthreads[close_thread].cksem);
+        wait_written(control, close_thread);
 
         if (++close_thread == control->threads) close_thread = 0;
     }
+    lock_mutex(control, &output_lock);
+    writer_stop = true;
+    cond_broadcast(control, &write_cond);
+    unlock_mutex(control, &output_lock);
+    join_pthread(control, writer, NULL);
+    outq_stop(control);
     dealloc(cthreads);
-    dealloc(control->pthreads);
+    buf_pool_trim(control);
     return true;
 }
 
@@ -778,6 +1119,8 @@ void * open_stream_out(rzip_control * control, int f, unsigned int n, i64 chunk_
     if (unlikely(!sinfo)) return NULL;
     if (chunk_limit < control->page_size) chunk_limit = control->page_size;
     sinfo->bufsize = sinfo->size = chunk_limit;
+    __atomic_store_n(&stream_closing, false, __ATOMIC_RELAXED);
+    buf_pool_reuse(control);
 
     sinfo->chunk_bytes = cbytes;
     sinfo->num_streams = n;
@@ -904,6 +1247,10 @@ void * open_stream_out(rzip_control * control, int f, unsigned int n, i64 chunk_
             stream_bufsize = round_up_page(control, (0x100000 << control->zpaq_bs) - 0x1000);
         else if (BZIP3_COMPRESS && (limit / control->threads > control->bzip3_block_size))
             stream_bufsize = round_up_page(control, control->bzip3_block_size - 0x1000);
+        else if (AUTO_COMPRESS && limit / control->threads > STREAM_BUFSIZE)
+            // as for lzma, but every block has to fit a bzip3 block too
+            stream_bufsize =
+                round_up_page(control, MIN(0x100000 << control->compression_level, control->bzip3_block_size - 0x1000));
         else if (LZMA_COMPRESS && limit / control->threads > STREAM_BUFSIZE)
             // for smaller dictionary sizes, need MAX test to bring in larger buffer from limit
             // limit = usable ram / 2
@@ -925,7 +1272,7 @@ void * open_stream_out(rzip_control * control, int f, unsigned int n, i64 chunk_
     sinfo->bufsize = stream_bufsize;
 
     for (i = 0; i < n; i++) {
-        sinfo->s[i].buf = calloc(sinfo->bufsize, 1);
+        sinfo->s[i].buf = buf_alloc(control, sinfo->bufsize);
         if (unlikely(!sinfo->s[i].buf)) {
             fatal("Unable to malloc buffer of size %'" PRId64 " in open_stream_out\n", sinfo->bufsize);
             dealloc(sinfo->s);
@@ -942,25 +1289,23 @@ void * open_stream_in(rzip_control * control, int f, int n, char chunk_bytes) {
     struct uncomp_thread * ucthreads;
     struct stream_info * sinfo;
     int total_threads, i;
-    pthread_t * threads;
     i64 header_length;
 
     sinfo = calloc(sizeof(struct stream_info), 1);
     if (unlikely(!sinfo)) return NULL;
+    buf_pool_reuse(control);
 
     /* We have one thread dedicated to stream 0, and one more thread than
-     * CPUs to keep them busy, unless we're running single-threaded. */
+     * CPUs to keep them busy, unless we're running single-threaded. Any
+     * streams past the first two get a thread each, after these. */
     if (control->threads > 1)
         total_threads = control->threads + 2;
     else
         total_threads = control->threads + 1;
-    threads = control->pthreads = calloc(sizeof(pthread_t), total_threads);
-    if (unlikely(!threads)) return NULL;
 
-    sinfo->ucthreads = ucthreads = calloc(sizeof(struct uncomp_thread), total_threads);
+    sinfo->ucthreads = ucthreads = calloc(sizeof(struct uncomp_thread), total_threads + n - 2);
     if (unlikely(!ucthreads)) {
         dealloc(sinfo);
-        dealloc(threads);
         fatal("Unable to calloc ucthreads in open_stream_in\n");
     }
 
@@ -971,13 +1316,14 @@ void * open_stream_in(rzip_control * control, int f, int n, char chunk_bytes) {
     sinfo->s = calloc(sizeof(struct stream), n);
     if (unlikely(!sinfo->s)) {
         dealloc(sinfo);
-        dealloc(threads);
         dealloc(ucthreads);
         return NULL;
     }
+    pool_reserve(control, total_threads + n - 2);
 
     sinfo->s[0].total_threads = 1;
     sinfo->s[1].total_threads = total_threads - 1;
+    for (i = 2; i < n; i++) sinfo->s[i].total_threads = 1;
 
     /* remove checks for mrzip < 0.6 */
     if (control->major_version == 0) {
@@ -1013,7 +1359,7 @@ void * open_stream_in(rzip_control * control, int f, int n, char chunk_bytes) {
         uchar c, enc_head[25 + SALT_LEN];
         i64 v1, v2;
 
-        sinfo->s[i].base_thread = i;
+        sinfo->s[i].base_thread = i < 2 ? i : total_threads + i - 2;
         sinfo->s[i].uthread_no = sinfo->s[i].base_thread;
         sinfo->s[i].unext_thread = sinfo->s[i].base_thread;
 
@@ -1074,7 +1420,6 @@ void * open_stream_in(rzip_control * control, int f, int n, char chunk_bytes) {
 failed:
     dealloc(sinfo->s);
     dealloc(sinfo);
-    dealloc(threads);
     dealloc(ucthreads);
     return NULL;
 }
@@ -1110,23 +1455,17 @@ error:
     return false;
 }
 
-/* Enter with s_buf allocated,s_buf points to the compressed data after the
- * backend compression and is then freed here */
-static void * compthread(void * data) {
-    stream_thread_struct * s = data;
-    rzip_control * control = s->control;
-    int current_thread = s->i;
+/* Enter with s_buf allocated, s_buf points to the compressed data after the
+ * backend compression and is left for the writer to commit */
+static void * compthread(struct pool_task * task) {
+    rzip_control * control = task->control;
+    int current_thread = task->no;
     struct compress_thread * cti;
-    struct stream_info * ctis;
-    int waited = 0, ret = 0;
+    int waited = 0, ret = 0, rung;
     i64 padded_len;
-    int write_len;
+    uchar c_type;
 
-    /* Make sure this thread doesn't already exist */
-
-    dealloc(data);
     cti = &cthreads[current_thread];
-    ctis = cti->sinfo;
 
     if (unlikely(setpriority(PRIO_PROCESS, 0, control->nice_val) == -1)) {
         print_err("Warning, unable to set thread nice value %'d...Resetting to %'d\n", control->nice_val,
@@ -1135,29 +1474,33 @@ static void * compthread(void * data) {
     }
     cti->c_type = CTYPE_NONE;
     cti->c_len = cti->s_len;
-
-    /* Flushing writes to disk frees up any dirty ram, improving chances
-     * of succeeding in allocating more ram */
-    fsync(ctis->fd);
+    rung = ratectl_pick(control, &c_type, &cti->level);
 retry:
     /* Very small buffers have issues to do with minimum amounts of ram
      * allocatable to a buffer combined with the MINIMUM_MATCH of rzip
      * being 31 bytes so don't bother trying to compress anything less
      * than 64 bytes. */
     if (!NO_COMPRESS && cti->c_len >= 64) {
+        double start = wall_seconds();
+
         /* Any Filter */
-        if (LZMA_COMPRESS)
-            ret = lzma_compress_buf(control, cti, current_thread);
+        if (c_type)
+            ret = compress_with(control, cti, task->codec, c_type, current_thread);
+        else if (AUTO_COMPRESS)
+            ret = auto_compress_buf(control, cti, task->codec, current_thread);
+        else if (LZMA_COMPRESS)
+            ret = lzma_compress_buf(control, cti, task->codec, current_thread);
         else if (LZ4_COMPRESS)
             ret = lz4_compress_buf(control, cti);
         else if (ZSTD_COMPRESS)
-            ret = zstd_compress_buf(control, cti);
+            ret = zstd_compress_buf(control, cti, task->codec);
         else if (ZPAQ_COMPRESS)
             ret = zpaq_compress_buf(control, cti, current_thread);
         else if (BZIP3_COMPRESS)
-            ret = bzip3_compress_buf(control, cti, current_thread);
+            ret = bzip3_compress_buf(control, cti, task->codec, current_thread);
         else
             fatal("Dunno wtf compression to use!\n");
+        if (!ret) ratectl_record(control, rung, cti->s_len, wall_seconds() - start);
     }
 
     padded_len = cti->c_len;
@@ -1167,29 +1510,71 @@ retry:
              * long or encryption cannot work. We pad it with random
              * data */
             if (padded_len < *control->enc_keylen) padded_len = *control->enc_keylen;
-            cti->s_buf = realloc(cti->s_buf, padded_len);
+            cti->s_buf = buf_grow(control, cti->s_buf, padded_len);
             if (unlikely(!cti->s_buf)) fatal("Failed to realloc s_buf in compthread\n");
             gcry_create_nonce(cti->s_buf + cti->c_len, padded_len - cti->c_len);
         }
     }
 
     /* If compression fails for whatever reason multithreaded, then wait
-     * for the previous thread to finish, serialising the work to decrease
-     * the memory requirements, increasing the chance of success */
-    if (unlikely(ret && waited)) fatal("Failed to compress in compthread\n");
-
-    if (!waited) {
+     * for the previous threads to be written, serialising the work to
+     * decrease the memory requirements, increasing the chance of success */
+    if (unlikely(ret)) {
+        if (unlikely(waited)) fatal("Failed to compress in compthread\n");
+        print_maxverbose(
+            "Unable to compress in parallel, waiting for previous thread to complete before trying again\n");
         lock_mutex(control, &output_lock);
         while (output_thread != current_thread) cond_wait(control, &output_cond, &output_lock);
         unlock_mutex(control, &output_lock);
         waited = 1;
-    }
-    if (unlikely(ret)) {
-        print_maxverbose(
-            "Unable to compress in parallel, waiting for previous thread to complete before trying again\n");
         goto retry;
     }
 
+    /* Hand the block to the writer, which commits blocks in order */
+    lock_mutex(control, &output_lock);
+    cti->ready = true;
+    cond_broadcast(control, &write_cond);
+    unlock_mutex(control, &output_lock);
+    return NULL;
+}
+
+/* As the rest of write_block below, with the block header and data written
+ * in one go and the previous block's header patched where it is */
+static void queue_block(rzip_control * control, struct compress_thread * cti, int current_thread, int write_len) {
+    struct stream_info * ctis = cti->sinfo;
+    struct stream * s = &ctis->s[cti->streamno];
+    uchar head[1 + 3 * 8];
+    i64 v;
+
+    print_maxverbose("Thread %'d queueing %'" PRId64 " compressed bytes from stream %'d at %'" PRId64 "\n",
+                     current_thread, cti->c_len, cti->streamno, ctis->cur_pos);
+    v = htole64(ctis->cur_pos);
+    outq_write(control, (uchar *)&v, write_len, NULL, 0, ctis->initial_pos + s->last_head);
+    s->last_head = ctis->cur_pos + 1 + (write_len * 2);
+
+    head[0] = cti->c_type;
+    v = htole64(cti->c_len);
+    memcpy(head + 1, &v, write_len);
+    v = htole64(cti->s_len);
+    memcpy(head + 1 + write_len, &v, write_len);
+    memset(head + 1 + (write_len * 2), 0, write_len);
+    outq_write(control, head, 1 + (write_len * 3), cti->s_buf, cti->c_len, ctis->initial_pos + ctis->cur_pos);
+    cti->s_buf = NULL;
+    ctis->cur_pos += 1 + (write_len * 3) + cti->c_len;
+}
+
+/* Write out the compressed block of thread current_thread and link it into
+ * the chain of its stream */
+static void write_block(rzip_control * control, struct compress_thread * cti, int current_thread) {
+    struct stream_info * ctis = cti->sinfo;
+    i64 padded_len = cti->c_len;
+    int write_len;
+
+    /* Don't run too far ahead of the disk */
+    writeback_throttle(control);
+
+    if (ENCRYPT && padded_len < *control->enc_keylen) padded_len = *control->enc_keylen;
+
     /* Need to be big enough to fill one CBC_LEN */
     if (ENCRYPT)
         write_len = 8;
@@ -1199,15 +1584,13 @@ retry:
     if (!ctis->chunks++) {
         int j;
 
+        outq_seek_end(control);
         if (TMP_OUTBUF) {
             lock_mutex(control, &control->control_lock);
             if (!control->magic_written) write_magic(control);
             unlock_mutex(control, &control->control_lock);
 
-            if (unlikely(!flush_tmpoutbuf(control))) {
-                print_err("Failed to flush_tmpoutbuf in compthread\n");
-                goto error;
-            }
+            if (unlikely(!flush_tmpoutbuf(control))) fatal("Failed to flush_tmpoutbuf in write_block\n");
         }
 
         print_maxverbose("Writing initial chunk bytes value %'d at %'" PRId64 "\n", ctis->chunk_bytes,
@@ -1223,7 +1606,7 @@ retry:
 
         /* First chunk of this stream, write headers */
         ctis->initial_pos = get_seek(control, ctis->fd);
-        if (unlikely(ctis->initial_pos == -1)) goto error;
+        if (unlikely(ctis->initial_pos == -1)) fatal("Failed to get_seek in write_block\n");
 
         print_maxverbose("Writing initial header at %'" PRId64 "\n", ctis->initial_pos);
         for (j = 0; j < ctis->num_streams; j++) {
@@ -1231,7 +1614,7 @@ retry:
              * later */
             if (ENCRYPT) {
                 if (unlikely(write_val(control, 0, SALT_LEN)))
-                    fatal("Failed to write_buf blank salt in compthread %'d\n", current_thread);
+                    fatal("Failed to write_buf blank salt in write_block %'d\n", current_thread);
                 ctis->cur_pos += SALT_LEN;
             }
             ctis->s[j].last_head = ctis->cur_pos + 1 + (write_len * 2);
@@ -1243,14 +1626,19 @@ retry:
         }
     }
 
+    if (control->outq.fd != -1) {
+        queue_block(control, cti, current_thread, write_len);
+        return;
+    }
+
     print_maxverbose("Compthread %'d seeking to %'" PRId64 " to store length %'d\n", current_thread,
                      ctis->s[cti->streamno].last_head, write_len);
 
     if (unlikely(seekto(control, ctis, ctis->s[cti->streamno].last_head)))
-        fatal("Failed to seekto in compthread %'d\n", current_thread);
+        fatal("Failed to seekto in write_block %'d\n", current_thread);
 
     if (unlikely(write_val(control, ctis->cur_pos, write_len)))
-        fatal("Failed to write_val cur_pos in compthread %'d\n", current_thread);
+        fatal("Failed to write_val cur_pos in write_block %'d\n", current_thread);
 
     if (ENCRYPT) rewrite_encrypted(control, ctis, ctis->s[cti->streamno].last_head - 17);
 
@@ -1259,58 +1647,83 @@ retry:
     print_maxverbose("Compthread %'d seeking to %'" PRId64 " to write header\n", current_thread, ctis->cur_pos);
 
     if (unlikely(seekto(control, ctis, ctis->cur_pos)))
-        fatal("Failed to seekto cur_pos in compthread %'d\n", current_thread);
+        fatal("Failed to seekto cur_pos in write_block %'d\n", current_thread);
 
     print_maxverbose("Thread %'d writing %'" PRId64 " compressed bytes from stream %'d\n", current_thread, padded_len,
                      cti->streamno);
 
     if (ENCRYPT) {
         if (unlikely(write_val(control, 0, SALT_LEN)))
-            fatal("Failed to write_buf header salt in compthread %'d\n", current_thread);
+            fatal("Failed to write_buf header salt in write_block %'d\n", current_thread);
         ctis->cur_pos += SALT_LEN;
         ctis->s[cti->streamno].last_headofs = ctis->cur_pos;
     }
     /* We store the actual c_len even though we might pad it out */
     if (unlikely(write_u8(control, cti->c_type) || write_val(control, cti->c_len, write_len) ||
                  write_val(control, cti->s_len, write_len) || write_val(control, 0, write_len))) {
-        fatal("Failed write in compthread %'d\n", current_thread);
+        fatal("Failed write in write_block %'d\n", current_thread);
     }
     ctis->cur_pos += 1 + (write_len * 3);
 
     if (ENCRYPT) {
         gcry_create_nonce(cti->salt, SALT_LEN);
         if (unlikely(write_buf(control, cti->salt, SALT_LEN)))
-            fatal("Failed to write_buf block salt in compthread %'d\n", current_thread);
-        if (unlikely(!lrz_encrypt(control, cti->s_buf, padded_len, cti->salt))) goto error;
+            fatal("Failed to write_buf block salt in write_block %'d\n", current_thread);
+        if (unlikely(!lrz_encrypt(control, cti->s_buf, padded_len, cti->salt)))
+            fatal("Failed to lrz_encrypt in write_block %'d\n", current_thread);
         ctis->cur_pos += SALT_LEN;
     }
 
     print_maxverbose("Compthread %'d writing data at %'" PRId64 "\n", current_thread, ctis->cur_pos);
 
     if (unlikely(write_buf(control, cti->s_buf, padded_len)))
-        fatal("Failed to write_buf s_buf in compthread %'d\n", current_thread);
+        fatal("Failed to write_buf s_buf in write_block %'d\n", current_thread);
 
     ctis->cur_pos += padded_len;
-    dealloc(cti->s_buf);
+    buf_dealloc(cti->s_buf);
+}
 
-    lock_mutex(control, &output_lock);
-    if (++output_thread == control->threads) output_thread = 0;
-    cond_broadcast(control, &output_cond);
-    unlock_mutex(control, &output_lock);
+/* Commit the blocks in the order they were handed out, so the threads never
+ * wait for each other before picking up the next block */
+static void * writer_thread(void * data) {
+    rzip_control * control = data;
 
-error:
-    cksem_post(control, &cti->cksem);
+    while (42) {
+        struct compress_thread * cti = &cthreads[output_thread];
+        bool ready;
 
+        outq_reap(control);
+        lock_mutex(control, &output_lock);
+        while (!cti->ready && !writer_stop) cond_wait(control, &write_cond, &output_lock);
+        ready = cti->ready;
+        unlock_mutex(control, &output_lock);
+        if (!ready) break;
+
+        write_block(control, cti, output_thread);
+
+        lock_mutex(control, &output_lock);
+        cti->ready = cti->busy = false;
+        if (++output_thread == control->threads) output_thread = 0;
+        cond_broadcast(control, &output_cond);
+        unlock_mutex(control, &output_lock);
+    }
     return NULL;
 }
 
+/* Wait till the buffer last handed to thread i is written out */
+static void wait_written(rzip_control * control, int i) {
+    lock_mutex(control, &output_lock);
+    while (cthreads[i].busy) cond_wait(control, &output_cond, &output_lock);
+    unlock_mutex(control, &output_lock);
+    pool_wait(control, &cthreads[i].task);
+}
+
 static void clear_buffer(rzip_control * control, struct stream_info * sinfo, int streamno, int newbuf) {
-    pthread_t * threads = control->pthreads;
-    stream_thread_struct * s;
     static int current_thread = 0;
 
-    /* Make sure this thread doesn't already exist */
-    cksem_wait(control, &cthreads[current_thread].cksem);
+    /* Make sure this thread is done with its last buffer */
+    wait_written(control, current_thread);
+    cthreads[current_thread].busy = true;
 
     cthreads[current_thread].sinfo = sinfo;
     cthreads[current_thread].streamno = streamno;
@@ -1320,21 +1733,12 @@ static void clear_buffer(rzip_control * control, struct stream_info * sinfo, int
     print_maxverbose("Starting thread %'d to compress %'" PRId64 " bytes from stream %'d\n", current_thread,
                      cthreads[current_thread].s_len, streamno);
 
-    s = malloc(sizeof(stream_thread_struct));
-    if (unlikely(!s)) {
-        cksem_post(control, &cthreads[current_thread].cksem);
-        fatal("Unable to malloc in clear_buffer");
-    }
-    s->i = current_thread;
-    s->control = control;
-    if (unlikely((!create_pthread(control, &threads[current_thread], NULL, compthread, s)) ||
-                 (!detach_pthread(control, &threads[current_thread]))))
-        fatal("Unable to create compthread in clear_buffer");
+    pool_submit(control, &cthreads[current_thread].task, compthread, sinfo, current_thread);
 
     if (newbuf) {
         /* The stream buffer has been given to the thread, allocate a
          * new one. */
-        sinfo->s[streamno].buf = malloc(sinfo->bufsize);
+        sinfo->s[streamno].buf = buf_alloc(control, sinfo->bufsize);
         if (unlikely(!sinfo->s[streamno].buf))
             fatal("Unable to malloc buffer of size %'" PRId64 " in flush_buffer\n", sinfo->bufsize);
         sinfo->s[streamno].buflen = 0;
@@ -1348,13 +1752,10 @@ void flush_buffer(rzip_control * control, struct stream_info * sinfo, int stream
     clear_buffer(control, sinfo, streamno, 1);
 }
 
-static void * ucompthread(void * data) {
-    stream_thread_struct * sts = data;
-    rzip_control * control = sts->control;
-    int waited = 0, ret = 0, current_thread = sts->i;
-    struct uncomp_thread * uci = &sts->sinfo->ucthreads[current_thread];
-
-    dealloc(data);
+static void * ucompthread(struct pool_task * task) {
+    rzip_control * control = task->control;
+    int waited = 0, ret = 0, current_thread = task->no;
+    struct uncomp_thread * uci = &task->sinfo->ucthreads[current_thread];
 
     if (unlikely(setpriority(PRIO_PROCESS, 0, control->nice_val) == -1)) {
         print_err("Warning, unable to set thread nice value %'d...Resetting to %'d\n", control->nice_val,
@@ -1366,19 +1767,19 @@ retry:
     if (uci->c_type != CTYPE_NONE) {
         switch (uci->c_type) {
             case CTYPE_LZMA:
-                ret = lzma_decompress_buf(control, uci);
+                ret = lzma_decompress_buf(control, uci, task->codec);
                 break;
             case CTYPE_LZ4:
                 ret = lz4_decompress_buf(control, uci);
                 break;
             case CTYPE_ZSTD:
-                ret = zstd_decompress_buf(control, uci);
+                ret = zstd_decompress_buf(control, uci, task->codec);
                 break;
             case CTYPE_ZPAQ:
                 ret = zpaq_decompress_buf(control, uci, current_thread);
                 break;
             case CTYPE_BZIP3:
-                ret = bzip3_decompress_buf(control, uci, current_thread);
+                ret = bzip3_decompress_buf(control, uci, task->codec, current_thread);
                 break;
             default:
                 fatal("Dunno wtf decompression type to use!\n");
@@ -1413,12 +1814,9 @@ static int fill_buffer(rzip_control * control, struct stream_info * sinfo, struc
     i64 u_len, c_len, last_head, padded_len, header_length, max_len;
     uchar enc_head[25 + SALT_LEN], blocksalt[SALT_LEN];
     struct uncomp_thread * ucthreads = sinfo->ucthreads;
-    pthread_t * threads = control->pthreads;
-    stream_thread_struct * sts;
     uchar c_type, *s_buf;
-    void * thr_return;
 
-    dealloc(s->buf);
+    buf_dealloc(s->buf);
     if (s->eos) goto out;
 fill_another:
     if (unlikely(ucthreads[s->uthread_no].busy)) fatal("Trying to start a busy thread, this shouldn't happen!\n");
@@ -1461,8 +1859,8 @@ fill_another:
                      c_len, u_len, last_head);
 
     /* It is possible for there to be an empty match block at the end of
-     * incompressible data */
-    if (unlikely(c_len == 0 && u_len == 0 && streamno == 1 && last_head == 0)) {
+     * incompressible data, and split streams may have no data at all */
+    if (unlikely(c_len == 0 && u_len == 0 && streamno > 0 && last_head == 0)) {
         print_maxverbose("Skipping empty match block\n");
         goto skip_empty;
     }
@@ -1493,25 +1891,25 @@ fill_another:
      * otherwise length = 0 */
     padded_len = MAX(c_len, *control->enc_keylen);
     sinfo->total_read += padded_len;
-    fsync(control->fd_out);
+    writeback_throttle(control);
 
     if (unlikely(u_len > control->maxram))
         print_progress("Warning, attempting to malloc very large buffer for this environment of size %'" PRId64 "\n",
                        u_len);
     max_len = MAX(u_len, *control->enc_keylen);
     max_len = MAX(max_len, c_len);
-    s_buf = malloc(max_len);
+    s_buf = buf_alloc(control, max_len);
     if (unlikely(!s_buf)) fatal("Unable to malloc buffer of size %'" PRId64 " in fill_buffer\n", u_len);
     sinfo->ram_alloced += u_len;
 
     if (unlikely(read_buf(control, sinfo->fd, s_buf, padded_len))) {
-        dealloc(s_buf);
+        buf_dealloc(s_buf);
         return -1;
     }
 
     // pass decrypt flag
     if (unlikely(ENCRYPT && !lrz_decrypt(control, s_buf, padded_len, blocksalt, LRZ_DECRYPT))) {
-        dealloc(s_buf);
+        buf_dealloc(s_buf);
         return -1;
     }
 
@@ -1527,15 +1925,7 @@ fill_another:
     print_maxverbose("Starting thread %d to decompress %'" PRId64 " bytes from stream %'d\n", s->uthread_no, padded_len,
                      streamno);
 
-    sts = malloc(sizeof(stream_thread_struct));
-    if (unlikely(!sts)) fatal("Unable to malloc in fill_buffer");
-    sts->i = s->uthread_no;
-    sts->control = control;
-    sts->sinfo = sinfo;
-    if (unlikely(!create_pthread(control, &threads[s->uthread_no], NULL, ucompthread, sts))) {
-        dealloc(sts);
-        return -1;
-    }
+    pool_submit(control, &ucthreads[s->uthread_no].task, ucompthread, sinfo, s->uthread_no);
 
     if (++s->uthread_no == s->base_thread + s->total_threads) s->uthread_no = s->base_thread;
 skip_empty:
@@ -1548,14 +1938,18 @@ skip_empty:
     else if (s->uthread_no != s->unext_thread && !ucthreads[s->uthread_no].busy && sinfo->ram_alloced < control->maxram)
         goto fill_another;
 out:
+    /* The stream ended with an empty block and there is nothing to wait for */
+    if (s->unext_thread == s->uthread_no && !ucthreads[s->unext_thread].busy) {
+        s->buflen = s->bufp = 0;
+        return 0;
+    }
     lock_mutex(control, &output_lock);
     output_thread = s->unext_thread;
     cond_broadcast(control, &output_cond);
     unlock_mutex(control, &output_lock);
 
-    /* join_pthread here will make it wait till the data is ready */
-    thr_return = NULL;
-    if (unlikely(!join_pthread(control, threads[s->unext_thread], &thr_return) || !!thr_return)) return -1;
+    /* pool_wait here will make it wait till the data is ready */
+    if (unlikely(pool_wait(control, &ucthreads[s->unext_thread].task))) return -1;
     ucthreads[s->unext_thread].busy = 0;
 
     print_maxverbose("Taking decompressed data from thread %d\n", s->unext_thread);
@@ -1624,7 +2018,10 @@ int close_stream_out(rzip_control * control, void * ss) {
     struct stream_info * sinfo = ss;
     int i;
 
+    __atomic_store_n(&stream_closing, true, __ATOMIC_RELAXED);
     for (i = 0; i < sinfo->num_streams; i++) clear_buffer(control, sinfo, i, 0);
+    pool_release_codecs(control);
+    buf_pool_trim(control);
 
     if (ENCRYPT) {
         /* Last two compressed blocks do not have an offset written
@@ -1633,8 +2030,7 @@ int close_stream_out(rzip_control * control, void * ss) {
         int close_thread = output_thread;
 
         for (i = 0; i < control->threads; i++) {
-            cksem_wait(control, &cthreads[close_thread].cksem);
-            cksem_post(control, &cthreads[close_thread].cksem);
+            wait_written(control, close_thread);
             if (++close_thread == control->threads) close_thread = 0;
         }
         for (i = 0; i < sinfo->num_streams; i++) rewrite_encrypted(control, sinfo, sinfo->s[i].last_headofs);
@@ -1654,7 +2050,6 @@ static void add_to_rulist(rzip_control * control, struct stream_info * sinfo) {
 
     if (unlikely(!node)) fatal("Failed to calloc struct node in add_rulist\n");
     node->sinfo = sinfo;
-    node->pthreads = control->pthreads;
     node->prev = control->rulist;
     control->ruhead = node;
 }
@@ -1664,11 +2059,21 @@ int close_stream_in(rzip_control * control, void * ss) {
     struct stream_info * sinfo = ss;
     int i;
 
+    /* A stream with no more data to give may still end in an empty block
+     * that was never read, which has to be skipped to find the next chunk */
+    for (i = 0; i < sinfo->num_streams; i++) {
+        struct stream * s = &sinfo->s[i];
+
+        if (!s->eos && s->bufp == s->buflen && unlikely(fill_buffer(control, sinfo, s, i))) return -1;
+    }
+
     print_maxverbose("Closing stream at %'" PRId64 ", want to seek to %'" PRId64 "\n",
                      get_readseek(control, control->fd_in), sinfo->initial_pos + sinfo->total_read);
     if (unlikely(read_seekto(control, sinfo, sinfo->total_read))) return -1;
 
-    for (i = 0; i < sinfo->num_streams; i++) dealloc(sinfo->s[i].buf);
+    for (i = 0; i < sinfo->num_streams; i++) buf_dealloc(sinfo->s[i].buf);
+    pool_release_codecs(control);
+    buf_pool_trim(control);
 
     output_thread = 0;
     /* We cannot safely release the sinfo and pthread data here till all
@@ -1678,56 +2083,102 @@ int close_stream_in(rzip_control * control, void * ss) {
     return 0;
 }
 
-/* As others are slow and lz4 very fast, it is worth doing a quick lz4 pass
-   to see if there is any compression at all with lz4 first. It is unlikely
-   that others will be able to compress if lz4 is unable to drop a single byte
-   so do not compress any block that is incompressible by lz4. */
-static int lz4_compresses(rzip_control * control, uchar * s_buf, i64 s_len) {
-    int in_len, d_len, buftest_size, test_len = s_len;
-    char *c_buf = NULL, *test_buf = (char *)s_buf;
-    /* set minimum buffer test size based on the length of the test stream */
-    double pct = 101; /* set to failure */
-    int return_value;
-    int workcounter = 0; /* count # of passes */
-    int lz4_ret;
-
-    in_len = MIN(test_len, STREAM_BUFSIZE);  // Set min of s_len or 10MB
-    buftest_size = in_len;
-    d_len = in_len + 1;
-
-    c_buf = malloc(d_len);
-    if (unlikely(!c_buf)) fatal("Unable to allocate c_buf in lz4_compresses\n");
-
-    /* Test progressively larger blocks at a time and as soon as anything
-       compressible is found, including with Threshold, jump out as a success */
-    while (test_len > 0) {
-        workcounter++;
-        lz4_ret = LZ4_compress_default((const char *)test_buf, c_buf, in_len, d_len);
-
-        /* Apply threshold limit if applicable */
-        if (lz4_ret > 0) {
-            pct = 100 * ((double)lz4_ret / (double)in_len);
-            if (lz4_ret < in_len * ((double)control->threshold / 100)) break;
-        }
+/* Rather than compressing a block to find out whether it compresses at all,
+ * estimate its compressed size from a sample. The test looks at up to
+ * ENTROPY_SAMPLES blocks of ENTROPY_SAMPLE bytes spread evenly over the
+ * buffer. It gathers an order 0 and an order 1 byte histogram and counts the
+ * 4 byte sequences already seen, which is what an LZ backend would turn into
+ * matches. Blocks estimated above the threshold are stored as they are. */
+#define ENTROPY_SAMPLE 4096
+#define ENTROPY_SAMPLES 256
+#define ENTROPY_HASH_BITS 12
+
+struct entropy_stats {
+    u32 o0[4][256];  /* Four banks so close repeats don't wait on each other */
+    u32 o1[16][256]; /* Context is the high nibble of the previous byte */
+    u32 seen[1 << ENTROPY_HASH_BITS];
+    i64 bytes, repeats;
+};
+
+static void entropy_sample(struct entropy_stats * st, const uchar * p, i64 len) {
+    i64 i;
 
-        /* expand and move buffer */
-        test_len -= in_len;
-        if (test_len > 0) {
-            // No. Don't move ptr. Just increase length tested
-            buftest_size += in_len;
-            if (buftest_size < STREAM_BUFSIZE) buftest_size <<= 1;
-            in_len = MIN(test_len, buftest_size);
-            d_len = in_len + 1;  // Make sure dlen is increased as buffer test does
-            c_buf = realloc(c_buf, d_len);
-            if (unlikely(!c_buf)) fatal("Unable to reallocate c_buf in lz4_compresses\n");
-        }
+    for (i = 0; i + 8 <= len; i += 8) {
+        uint64_t w;
+
+        memcpy(&w, p + i, 8);
+        st->o0[0][w & 0xff]++;
+        st->o0[1][(w >> 8) & 0xff]++;
+        st->o0[2][(w >> 16) & 0xff]++;
+        st->o0[3][(w >> 24) & 0xff]++;
+        st->o0[0][(w >> 32) & 0xff]++;
+        st->o0[1][(w >> 40) & 0xff]++;
+        st->o0[2][(w >> 48) & 0xff]++;
+        st->o0[3][w >> 56]++;
     }
-    /* if pct >0 and <1 round up so return value won't show failed */
-    return_value = (int)(pct > control->threshold ? 0 : pct < 1 ? pct + 1 : pct);
-    print_maxverbose("lz4 testing %s for chunk %'" PRId32 ". Compressed size = %5.2F%% of test size %'d, %'d Passes\n",
-                     (return_value > 0 ? "OK" : "FAILED"), s_len, pct, buftest_size, workcounter);
+    for (; i < len; i++) st->o0[0][p[i]]++;
+
+    for (i = 1; i < len; i++) st->o1[p[i - 1] >> 4][p[i]]++;
+    for (i = 0; i + 4 <= len; i++) {
+        u32 v, h;
+
+        memcpy(&v, p + i, 4);
+        h = (v * 2654435761U) >> (32 - ENTROPY_HASH_BITS);
+        st->repeats += st->seen[h] == v;
+        st->seen[h] = v;
+    }
+    st->bytes += len;
+}
 
-    dealloc(c_buf);
+/* Shannon entropy in bits per symbol of n symbols counted in c */
+static double entropy_bits(const u32 * c, int symbols, i64 n) {
+    double sum = 0;
+    int i;
+
+    if (!n) return 0;
+    for (i = 0; i < symbols; i++)
+        if (c[i]) sum += c[i] * log2(c[i]);
+    return log2(n) - sum / n;
+}
+
+/* Estimated size after compression, in percent of s_len */
+static double entropy_estimate(uchar * s_buf, i64 s_len) {
+    struct entropy_stats * st;
+    double h0, h1 = 0, rep;
+    i64 i, n, ctx_n;
+    u32 o0[256];
+    int c, j;
+
+    st = calloc(1, sizeof(*st));
+    if (unlikely(!st)) return 100;
+    if (s_len <= ENTROPY_SAMPLE * ENTROPY_SAMPLES)
+        entropy_sample(st, s_buf, s_len);
+    else
+        for (i = 0; i < ENTROPY_SAMPLES; i++)
+            entropy_sample(st, s_buf + i * (s_len - ENTROPY_SAMPLE) / (ENTROPY_SAMPLES - 1), ENTROPY_SAMPLE);
+
+    for (j = 0; j < 256; j++) o0[j] = st->o0[0][j] + st->o0[1][j] + st->o0[2][j] + st->o0[3][j];
+    h0 = entropy_bits(o0, 256, st->bytes);
+    for (c = 0, n = 0; c < 16; c++) {
+        for (j = 0, ctx_n = 0; j < 256; j++) ctx_n += st->o1[c][j];
+        h1 += ctx_n * entropy_bits(st->o1[c], 256, ctx_n);
+        n += ctx_n;
+    }
+    h1 = n ? h1 / n : h0;
+    rep = st->bytes > 4 ? (double)st->repeats / (st->bytes - 3) : 0;
+    dealloc(st);
+
+    /* Repeated bytes are coded as matches for a fraction of a bit each */
+    return 100 * ((1 - rep) * MIN(h0, h1) / 8 + rep / 32);
+}
+
+static int entropy_compresses(rzip_control * control, uchar * s_buf, i64 s_len) {
+    double pct = entropy_estimate(s_buf, s_len);
+    int return_value;
 
+    /* if pct >0 and <1 round up so return value won't show failed */
+    return_value = (int)(pct > control->threshold ? 0 : pct < 1 ? pct + 1 : pct);
+    print_maxverbose("Entropy testing %s for chunk %'" PRId64 ". Estimated compressed size = %5.2F%%\n",
+                     (return_value > 0 ? "OK" : "FAILED"), s_len, pct);
     return return_value;
 }
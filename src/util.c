@@ -148,6 +148,13 @@ void setup_overhead(rzip_control * control) {
         }
         control->bzip3_block_size = BZIP3_BLOCK_SIZE_FROM_PROP(control->bzip3_bs);
         control->overhead = (i64)control->bzip3_block_size * 6;
+    } else if (AUTO_COMPRESS) {
+        /* Any block may end up with lzma or bzip3, budget for the larger:
+         * the trials' contexts are freed for all but the backend picked.
+         * bzip3 keeps its smallest block size unless told otherwise. */
+        control->bzip3_block_size = BZIP3_BLOCK_SIZE_FROM_PROP(control->bzip3_bs);
+        control->overhead =
+            MAX((i64)(1 << control->compression_level) * ONE_MB, (i64)control->bzip3_block_size * 6);
     }
 
     /* no need for zpaq computation here. do in open_stream_out() */
@@ -226,8 +233,11 @@ bool read_config(rzip_control * control) {
             control->rzip_compression_level = atoi(parametervalue);
             if (control->rzip_compression_level < 1 || control->rzip_compression_level > 9)
                 fatal("CONF.FILE error. RZIP Compression Level must between 1 and 9\n");
+        } else if (isparameter(parameter, "rzipthreads")) {
+            control->rzip_threads = atoi(parametervalue);
+            if (control->rzip_threads < 1) fatal("CONF.FILE error. RZIP threads must be at least 1\n");
         } else if (isparameter(parameter, "compressionmethod")) {
-            /* valid are rzip, zstd, lz4, lzma (default), and zpaq */
+            /* valid are rzip, zstd, lz4, lzma (default), zpaq, bzip3 and auto */
             if (control->flags & FLAG_NOT_LZMA) fatal("CONF.FILE error. Can only specify one compression method\n");
             if (isparameter(parametervalue, "zstd"))
                 control->flags |= FLAG_ZSTD_COMPRESS;
@@ -239,16 +249,18 @@ bool read_config(rzip_control * control) {
                 control->flags |= FLAG_ZPAQ_COMPRESS;
             else if (isparameter(parametervalue, "bzip3"))
                 control->flags |= FLAG_BZIP3_COMPRESS;
+            else if (isparameter(parametervalue, "auto"))
+                control->flags |= FLAG_AUTO_COMPRESS;
             else if (!isparameter(parametervalue, "lzma")) /* oops, not lzma! */
                 fatal("CONF.FILE error. Invalid compression method %s specified\n", parametervalue);
         } else if (isparameter(parameter, "lz4test")) {
             /* default is yes */
             if (isparameter(parametervalue, "no")) control->flags &= ~FLAG_THRESHOLD;
         } else if (isparameter(parameter, "threshold")) {
-            /* default is 100 */
+            /* default is 98 */
             control->threshold = atoi(parametervalue);
             if (control->threshold < 1 || control->threshold > 99)
-                fatal("CONF.FILE error. LZ4 Threshold must be between 1 and 99\n");
+                fatal("CONF.FILE error. Threshold must be between 1 and 99\n");
         } else if (isparameter(parameter, "hashcheck")) {
             if (isparameter(parametervalue, "yes")) {
                 control->flags |= FLAG_CHECK;
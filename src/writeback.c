@@ -0,0 +1,150 @@
+/*
+   Copyright (C) 2022 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE /* sync_file_range() */
+
+#include "../include/writeback.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../include/stream.h"
+#include "../include/util.h"
+
+/* With the periodic policy a thread looks at the output every
+ * WRITEBACK_TICK microseconds. Once WRITEBACK_CHUNK bytes were added it waits
+ * for the range it started last time and starts writing back the new one,
+ * so the pipeline never blocks on the disk itself. Writers that get more
+ * than WRITEBACK_DIRTY_MAX bytes ahead of what is on disk wait for it, which
+ * keeps dirty pages from piling up when the disk is slower than we are. */
+#define WRITEBACK_TICK 100000
+#define WRITEBACK_CHUNK (8 * ONE_MB)
+#define WRITEBACK_DIRTY_MAX (64 * ONE_MB)
+
+static i64 file_size(int fd) {
+    struct stat st;
+
+    return fstat(fd, &st) ? 0 : st.st_size;
+}
+
+#ifndef NO_SYNC_FILE_RANGE
+/* False if sync_file_range() is not there after all, I/O errors are fatal
+ * as the fsync() they replace would have made them */
+static bool sync_range(rzip_control * control, int fd, i64 ofs, i64 len, unsigned flags) {
+    if (likely(!sync_file_range(fd, ofs, len, flags))) return true;
+    if (errno == ENOSYS) return false;
+    fatal("Failed to write back %'" PRId64 " bytes of output at %'" PRId64 ": %s\n", len, ofs, strerror(errno));
+    return false;
+}
+
+static void * writeback_thread(void * data) {
+    rzip_control * control = data;
+    struct writeback * wb = &control->writeback;
+    i64 started = 0; /* End of the range last handed to the kernel */
+
+    lock_mutex(control, &wb->lock);
+    while (!wb->stop) {
+        i64 clean = wb->clean, end;
+        bool waiting = wb->waiting;
+
+        unlock_mutex(control, &wb->lock);
+        end = MAX(file_size(wb->fd), started);
+        if (end - started >= WRITEBACK_CHUNK || (waiting && clean < end)) {
+            bool ok = true;
+
+            if (started > clean)
+                ok = sync_range(control, wb->fd, clean, started - clean,
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            if (ok && end > started) ok = sync_range(control, wb->fd, started, end - started, SYNC_FILE_RANGE_WRITE);
+            lock_mutex(control, &wb->lock);
+            if (unlikely(!ok)) {
+                print_verbose("No sync_file_range(), leaving writeback to the kernel\n");
+                wb->stop = true;
+                cond_broadcast(control, &wb->done);
+                break;
+            }
+            wb->clean = started;
+            cond_broadcast(control, &wb->done);
+            started = end;
+            continue;
+        }
+
+        lock_mutex(control, &wb->lock);
+        if (!wb->stop && !wb->waiting) cond_timedwait(control, &wb->cond, &wb->lock, WRITEBACK_TICK);
+    }
+    unlock_mutex(control, &wb->lock);
+    return NULL;
+}
+#endif
+
+/* Start looking after the output written to fd, a regular file */
+void writeback_start(rzip_control * control, int fd) {
+    struct writeback * wb = &control->writeback;
+    struct stat st;
+
+    wb->fd = fd;
+    wb->running = false;
+    if (wb->policy != WRITEBACK_PERIODIC || fstat(fd, &st) || !S_ISREG(st.st_mode)) return;
+#ifndef NO_SYNC_FILE_RANGE
+    wb->clean = 0;
+    wb->waiting = wb->stop = false;
+    init_mutex(control, &wb->lock);
+    init_cond(control, &wb->cond);
+    init_cond(control, &wb->done);
+    create_pthread(control, &wb->thread, NULL, writeback_thread, control);
+    wb->running = true;
+#endif
+}
+
+/* Called before writing out a block, waits while too much is still dirty */
+void writeback_throttle(rzip_control * control) {
+    struct writeback * wb = &control->writeback;
+    i64 size;
+
+    if (!wb->running) return;
+    size = file_size(wb->fd);
+    lock_mutex(control, &wb->lock);
+    while (size - wb->clean > WRITEBACK_DIRTY_MAX && !wb->stop) {
+        wb->waiting = true;
+        cond_broadcast(control, &wb->cond);
+        cond_wait(control, &wb->done, &wb->lock);
+    }
+    wb->waiting = false;
+    unlock_mutex(control, &wb->lock);
+}
+
+/* The output is complete, fsync it if that's the policy */
+void writeback_stop(rzip_control * control) {
+    struct writeback * wb = &control->writeback;
+
+    if (wb->running) {
+        lock_mutex(control, &wb->lock);
+        wb->stop = true;
+        cond_broadcast(control, &wb->cond);
+        cond_broadcast(control, &wb->done);
+        unlock_mutex(control, &wb->lock);
+        join_pthread(control, wb->thread, NULL);
+        pthread_cond_destroy(&wb->cond);
+        pthread_cond_destroy(&wb->done);
+        pthread_mutex_destroy(&wb->lock);
+        wb->running = false;
+    }
+    if (wb->policy == WRITEBACK_CLOSE && wb->fd != -1 && unlikely(fsync(wb->fd)))
+        fatal("Failed to fsync output file\n");
+    wb->fd = -1;
+}